@@ -8,11 +8,15 @@ LOCAL_CFLAGS+=-I$(LOCAL_PATH)/khronos
 LOCAL_CFLAGS+=-g
 LOCAL_SRC_FILES=\
 	main.c \
+	pacer.c \
+	timing.c \
+	trace.c \
+	replay.c \
 	gfx.c \
 	texmmap.c \
 	shader.c \
 	gldebug.c \
 	glxw.c
-LOCAL_LDLIBS=-landroid -llog -lEGL -lGLESv2
+LOCAL_LDLIBS=-landroid -llog -ldl -lEGL -lGLESv2
 
 include $(BUILD_SHARED_LIBRARY)
@@ -1,25 +1,48 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
 #include <pthread.h>
 
 #include <GLXW/glxw.h>
 
+#include "gldebug.h"
+
 #include <android/log.h>
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
 #define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
 
-extern void APIENTRY gl_debug_callback(GLenum, GLenum, GLuint, GLenum, GLsizei, const GLchar *, const void*);
-
-extern unsigned shader_compile(const char *vert, const char *tess_ctrl, const char *tess_eval, const char *geom, const char *frag);
+extern unsigned shader_begin(const char *vert, const char *tess_ctrl, const char *tess_eval, const char *geom, const char *frag);
+extern unsigned shader_finish(unsigned prog);
+extern void shader_delete(unsigned prog);
 
 struct texmmap;
 void* texmmap_ptr(struct texmmap* texmmap);
 uint64_t texmmap_size(const struct texmmap *texmmap);
 
+// NOTE: same phases as in timing.c
+enum timing_phase { TIMING_FINISH, TIMING_REQUEST, TIMING_DRAW, TIMING_UPLOAD, TIMING_SWAP };
+struct timing;
+extern struct timing timing_;
+void timing_phase_begin(struct timing *timing, int phase);
+void timing_phase_end(struct timing *timing, int phase);
+
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_flow_begin(const char *name, uint64_t id);
+void trace_flow_step(const char *name, uint64_t id);
+void trace_flow_end(const char *name, uint64_t id);
+void trace_counter(const char *name, uint64_t value);
+void trace_thread_name(const char *name);
+
 struct painter_state {
     float scroll_x, scroll_y;
-    float scroll_vx, scroll_vy;
+    float scroll_vx, scroll_vy; // texels per second
+    float scroll_ax, scroll_ay; // texels per second^2
+    float zoom; // log2 of pixels per texel, about the screen center
+    float rotation; // radians, clockwise on screen
+    float slice; // array layer or 3D slice shown, wraps around the depth
 };
 
 struct astc_header
@@ -33,16 +56,151 @@ struct astc_header
         uint8_t zsize[3];
 };
 
-#define XFER_NUM_BUFFERS (8)
+// 3D ASTC formats from OES_texture_compressed_astc
+#ifndef GL_COMPRESSED_RGBA_ASTC_3x3x3_OES
+#define GL_COMPRESSED_RGBA_ASTC_3x3x3_OES 0x93C0
+#define GL_COMPRESSED_RGBA_ASTC_4x3x3_OES 0x93C1
+#define GL_COMPRESSED_RGBA_ASTC_4x4x3_OES 0x93C2
+#define GL_COMPRESSED_RGBA_ASTC_4x4x4_OES 0x93C3
+#define GL_COMPRESSED_RGBA_ASTC_5x4x4_OES 0x93C4
+#define GL_COMPRESSED_RGBA_ASTC_5x5x4_OES 0x93C5
+#define GL_COMPRESSED_RGBA_ASTC_5x5x5_OES 0x93C6
+#define GL_COMPRESSED_RGBA_ASTC_6x5x5_OES 0x93C7
+#define GL_COMPRESSED_RGBA_ASTC_6x6x5_OES 0x93C8
+#define GL_COMPRESSED_RGBA_ASTC_6x6x6_OES 0x93C9
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static uint64_t time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#define PAGE_ABSENT     0
+#define PAGE_QUEUED     1 // waiting for a blit worker
+#define PAGE_BLITTING   2
+#define PAGE_UPLOADING  3
+#define PAGE_RESIDENT   4
+#define PAGE_EVICTING   5 // waiting for frames in flight before uncommit
+#define PAGE_RELEASING  6 // uncommit batch being collected
+
+#define PAGE_WANTED_NONE        0
+#define PAGE_WANTED_PREDICTED   1 // view extrapolated over the request latency
+#define PAGE_WANTED_SAMPLED     2 // sampled by a recent frame
+
+struct page_entry {
+    uint8_t state; // NOTE: atomic, advanced by the pipeline stage that owns the page
+    uint8_t referenced; // CLOCK reference bit
+    uint8_t wanted; // PAGE_WANTED_*, never evicted
+
+    uint32_t hits; // feedback samples, including those of finer levels
+    uint32_t slot; // atlas slot + 1 without sparse textures, 0 if none
+
+    uint64_t request_frame;
+    uint64_t request_time;
+    uint64_t used_frame;
+    uint64_t evict_frame;
+};
+
+// Slices of pages_y rows are stacked along y, a row of the table is
+// row = page_z * pages_y + page_y, rectangles never span slices.
+struct page_table {
+    int pages_x, pages_y, pages_z;
+    int num_rows;
+    int page_width, page_height;
+
+    struct page_entry *entries;
+
+    // page cache, only touched by the painter
+    int num_committed;
+    int num_evicting;
+    int clock_hand;
+};
+
+// committed pages are kept until the cache exceeds its budget, then evicted
+// down to the low watermark
+#define GFX_CACHE_BUDGET (64 * 1024*1024)
+#define GFX_CACHE_LOW_WATERMARK(budget) ((budget) / 8 * 7)
+
+#define GFX_MAX_FRAME_FENCES (8)
+
+#define GFX_MAX_LEVELS (16)
+#define GFX_MAX_LAYERS (4)
+
+// the fragment shader reports the page it wants for one pixel in each
+// stride x stride block, read back a few frames later
+#define GFX_FEEDBACK_BUFFERS (4)
+#define GFX_FEEDBACK_STRIDE (8)
+
+// limit on how far ahead of the view pages are prefetched
+#define GFX_PREFETCH_MAX_SCREENS (2)
+
+// frames are only painted where the view or resident pages changed, the
+// damage of a few frames is kept for buffers older than one frame
+#define GFX_DAMAGE_HISTORY (4)
+#define GFX_MAX_DAMAGE_RECTS (8)
+
+// screen rectangles x, y, width, height, bottom up
+struct gfx_damage {
+    int full;
+    int num_rects;
+    int rects[GFX_MAX_DAMAGE_RECTS][4];
+};
+
+// without ARB_sparse_texture pages are copied into slots of an atlas
+// texture, pages are about this many texels wide
+#define GFX_ATLAS_PAGE_SIZE (128)
+#define GFX_FORCE_ATLAS (0)
+
+// scroll, zoom and rotate on their own instead of following touch input
+#define GFX_DEMO_SCROLL (0)
+
+struct gfx_feedback {
+    unsigned ssbo;
+    uint32_t *hits; // NOTE: persistently mapped, one counter per page
+    GLsync syncpt;
+};
+
+struct page_request {
+    int layer;
+    int wanted;
+    int level;
+    int page_x, page_y;
+    uint32_t hits;
+};
+
+struct gfx_level {
+    const uint8_t *data; // compressed blocks in the mmapped file
+    int width, height, depth;
+    int src_pitch, src_slice_pitch;
+};
+
+#define XFER_MIN_BUFFERS (2)
+#define XFER_MAX_BUFFERS (32)
 #define XFER_BUFFER_SIZE (2 * 1024*1024)
 
+// staging pool grows when starved for this many consecutive frames,
+// up to a memory cap, and shrinks a buffer for every while it stays fully
+// idle, timed rather than counted in frames since nothing is painted then
+#define XFER_POOL_MAX_BYTES (48 * 1024*1024)
+#define XFER_POOL_GROW_FRAMES (2)
+#define XFER_POOL_SHRINK_TIME (10ull * 1000000000)
+
 #define XFER_NUM_QUEUES         4
 #define XFER_QUEUE_IDLE         0
 #define XFER_QUEUE_READ         1
 #define XFER_QUEUE_UPLOAD       2
 #define XFER_QUEUE_WAIT         3
 
-#define XFER_QUEUE_MAX_SIZE  (XFER_NUM_BUFFERS+1) // XXX: queue must never get full!
+// queue depth counters in traces
+static const char *xfer_queue_names[XFER_NUM_QUEUES] = {
+    "queue idle", "queue read", "queue upload", "queue wait"
+};
+
+#define XFER_QUEUE_MAX_SIZE  (XFER_MAX_BUFFERS+1) // XXX: queue must never get full!
 
 #define XFER_NUM_THREADS        4
 
@@ -51,24 +209,32 @@ struct xfer_buffer {
     void *pbo_buffer;
     unsigned pbo;
 
-    unsigned timer_query;
-    GLsync syncpt; // NOTE: opaque pointer
+    GLsync syncpt; // NOTE: opaque pointer, shared by all uploads of a frame
 
     void *src_ptr;
     int tex_format;
 
-    int src_x, src_y;
-    int width, height;
-    int src_pitch;
+    int src_x, src_y, src_z;
+    int width, height, depth;
+    int src_pitch, src_slice_pitch;
 
-    unsigned dst_tex;
-    int dst_x, dst_y;
+    unsigned dst_target, dst_tex;
+    int dst_x, dst_y, dst_z, dst_level;
 
-    int block_width, block_height, block_size;
+    int block_width, block_height, block_depth, block_size;
+    int page_width, page_height, page_depth;
+
+    struct page_table *page_table;
 
+    // atlas uploads also point the indirection texel of the page at its slot
+    unsigned indirection;
+    int indirection_x, indirection_y, indirection_level;
+    uint32_t indirection_slot;
+
+    uint64_t xfer_id;
     uint64_t blit_time;
-    uint64_t upload_time;
     uint64_t start_frame;
+    uint64_t start_time;
 };
 
 struct xfer_queue {
@@ -81,15 +247,75 @@ struct xfer_queue {
     pthread_cond_t queue_not_empty[XFER_NUM_QUEUES];
 };
 
+#define XFER_QUERY_POOL_SIZE (32)
+
+struct xfer_query {
+    unsigned timestamps[2]; // GL_TIMESTAMP before and after the upload
+
+    // originating transfer
+    uint64_t xfer_id;
+    int num_pages;
+    uint64_t num_bytes;
+};
+
+// NOTE: owned by the context that performs uploads
+struct xfer_query_pool {
+    struct xfer_query queries[XFER_QUERY_POOL_SIZE];
+    int rd, wr; // in-flight queries, oldest first
+};
+
 #define XFER_BENCHMARK_SIZE (4096)
 #define XFER_BENCHMARK_HISTOGRAM (16)
 
+#define XFER_LATENCY_AVERAGE (8) // samples in the latency moving average
+
+// uploads stop this long before the present deadline
+#define XFER_DEADLINE_MARGIN (2 * 1000000)
+
 struct xfer {
-    struct xfer_buffer buffers[XFER_NUM_BUFFERS];
+    struct xfer_buffer buffers[XFER_MAX_BUFFERS];
     struct xfer_queue queue;
 
+    // staging pool size, only changed by the painter
+    int num_buffers;
+    uint64_t buffer_size;
+    int starved_frames;
+    uint64_t starved_frame;
+    uint64_t idle_since; // 0 while buffers are in use
+
     pthread_t threads[XFER_NUM_THREADS];
 
+    // uploads run on a separate thread with a shared GL context
+    int upload_thread;
+
+    // wakes up the painter, repaint = 0 when blits are ready to upload
+    void (*notify)(void *data, int repaint);
+    void *notify_data;
+
+    struct xfer_query_pool query_pool;
+    uint64_t next_xfer_id;
+
+    // uploaded buffers in fence order, owned by the painter
+    int retire[XFER_QUEUE_MAX_SIZE];
+    int retire_rd, retire_wr;
+
+    // request to resident time, moving average, 0 until measured
+    uint64_t resident_latency;
+
+    // NOTE: atomic, vsync the current frame is presented at, 0 if none
+    uint64_t upload_deadline;
+
+    // NOTE: atomic, fence after the painter's latest uncommits, taken by the
+    // upload context before it writes pages that may be requested again
+    GLsync release_syncpt;
+
+    // texel rectangles made resident by the last xfer_finish, owned by the painter
+    struct xfer_resident {
+        const struct page_table *page_table;
+        int x0, y0, x1, y1;
+    } resident[XFER_QUEUE_MAX_SIZE];
+    int num_resident;
+
     // benchmarking results:
     uint64_t upload_times[XFER_BENCHMARK_SIZE];
     int upload_idx;
@@ -100,24 +326,86 @@ struct xfer {
     uint64_t latency_histogram[XFER_BENCHMARK_HISTOGRAM];
 };
 
+// a sparse texture streamed from its own file, all layers share the
+// transfer pool, the page cache budget and the feedback buffers
+struct gfx_layer {
+    unsigned target; // GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY or GL_TEXTURE_3D
+    unsigned texture;
+
+    struct texmmap *texmmap;
+
+    int tex_format;
+    int tex_width, tex_height, tex_depth;
+    int page_width, page_height, page_depth;
+    int block_width, block_height, block_depth, block_size;
+
+    float scale; // texels per base layer texel
+    int slice; // array layer or 3D slice shown
+
+    // levels from num_sparse_levels on form the mip tail, which is
+    // committed and uploaded once and always resident
+    struct gfx_level levels[GFX_MAX_LEVELS];
+    int num_levels, num_sparse_levels;
+
+    struct page_table page_tables[GFX_MAX_LEVELS];
+
+    int feedback_offsets[GFX_MAX_LEVELS]; // first counter of each level
+
+    uint64_t served_bytes; // recently requested, decays every frame
+
+    // atlas backend, the texture is the atlas and the indirection texture
+    // holds slot + 1 of every virtual page, 0 if absent
+    unsigned indirection;
+    unsigned tail; // mip tail levels, the atlas only holds pages
+    int atlas_pages_x, atlas_pages_y;
+    uint32_t *free_slots;
+    int num_free_slots;
+};
+
 struct gfx {
     unsigned program;
 
     unsigned vbo;
     unsigned vao;
 
-    unsigned texture;
+    struct gfx_layer layers[GFX_MAX_LAYERS];
+    int num_layers;
 
-    struct texmmap *texmmap;
+    struct xfer xfer;
 
-    int tex_format;
-    int tex_width, tex_height;
-    int page_width, page_height, page_depth;
-    int block_width, block_height, block_size;
+    int sparse; // ARB_sparse_texture, otherwise layers use an atlas
 
-    struct xfer xfer;
+    uint64_t cache_budget;
+
+    struct page_request *page_requests;
+    int max_page_requests;
+
+    struct gfx_feedback feedback[GFX_FEEDBACK_BUFFERS];
+    int feedback_size;
+    int feedback_rd, feedback_wr;
+    uint64_t feedback_reads;
+
+    // frames in flight that may still sample evicted pages
+    GLsync frame_fences[GFX_MAX_FRAME_FENCES];
+    uint64_t fence_frames[GFX_MAX_FRAME_FENCES];
+    int fence_rd, fence_wr;
+    uint64_t completed_frames; // all frames before this one have finished
+
+    // view of the frame being painted, pixels map to texels at
+    // view_origin + view_matrix * pixel
+    int view_width, view_height;
+    float view_origin[2];
+    float view_matrix[4]; // column major
+    float view_zoom;
 
-    int rect_page_x0, rect_page_y0, rect_page_x1, rect_page_y1;
+    // damage of painted frames, the next frame's at damage_wr
+    struct gfx_damage damage[GFX_DAMAGE_HISTORY];
+    int damage_wr;
+
+    // feedback samples and those that wanted a page not resident yet
+    uint64_t feedback_samples, feedback_missing;
+
+    int invalid; // the next update paints everything
 };
 
 struct gfx gfx_;
@@ -134,20 +422,80 @@ static const char *vertex_src = ""
 
 static const char *frag_src = ""
     "#version 450\n"
-    "#extension GL_EXT_sparse_texture2 : enable\n"
+    "#extension GL_EXT_sparse_texture2 : enable\n" // NOTE: warns if unsupported
     "layout(location = 0) uniform sampler2D tex;"
-    "layout(location = 1) uniform int scroll_x;"
-    "layout(location = 2) uniform int scroll_y;"
+    "layout(location = 3) uniform int num_levels;"
+    "layout(location = 4) uniform ivec3 page_size;"
+    "layout(location = 5) uniform int feedback_stride;"
+    "layout(location = 6) uniform ivec2 feedback_jitter;"
+    "layout(location = 7) uniform int feedback_offset[16];"
+    "layout(location = 23) uniform float layer_scale;"
+    "layout(location = 24) uniform vec4 missing_color;"
+    "layout(location = 25) uniform sampler2DArray tex_array;"
+    "layout(location = 26) uniform sampler3D tex_3d;"
+    "layout(location = 27) uniform int tex_target;" // 0: 2D, 1: 2D array, 2: 3D, 3: atlas
+    "layout(location = 28) uniform int slice;"
+    "layout(location = 29) uniform usampler2D indirection;"
+    "layout(location = 30) uniform sampler2D tail;"
+    "layout(location = 31) uniform int tail_level;"
+    "layout(location = 32) uniform int atlas_pages_x;"
+    "layout(location = 33) uniform vec2 view_origin;" // texel at the first pixel
+    "layout(location = 34) uniform mat2 view_matrix;" // texels per pixel, rotated
+    "layout(location = 36) uniform int view_level;"
+    "layout(std430, binding = 0) buffer feedback_buffer { uint feedback[]; };"
     "out vec4 color;"
+    // array layers have the same count on every level, 3D slices halve
+    "ivec3 tex_size(int level) {"
+        "if(tex_target == 1) return textureSize(tex_array, level);"
+        "if(tex_target == 2) return textureSize(tex_3d, level);"
+        "if(tex_target == 3) return ivec3(textureSize(indirection, level) * page_size.xy, 1);"
+        "return ivec3(textureSize(tex, level), 1);"
+    "}"
+    // true if the texel is resident
+    "bool fetch(ivec2 coord, int level, out vec4 texel) {"
+        "texel = vec4(0.0);"
+        "if(tex_target == 3) {"
+            "ivec2 c = coord >> level;"
+            "if(level >= tail_level) { texel = texelFetch(tail, c, level - tail_level); return true; }"
+            "ivec2 page = c / page_size.xy;"
+            "if(any(greaterThanEqual(page, textureSize(indirection, level)))) return false;"
+            "uint slot = texelFetch(indirection, page, level).r;"
+            "if(slot == 0u) return false;"
+            "ivec2 atlas_page = ivec2(int(slot - 1u) % atlas_pages_x, int(slot - 1u) / atlas_pages_x);"
+            "texel = texelFetch(tex, atlas_page * page_size.xy + c % page_size.xy, 0);"
+            "return true;"
+        "}"
+    "\n#ifdef GL_EXT_sparse_texture2\n"
+        "if(tex_target == 1) return sparseTexelsResidentEXT(sparseTexelFetchEXT(tex_array, ivec3(coord >> level, slice), level, texel));"
+        "if(tex_target == 2) return sparseTexelsResidentEXT(sparseTexelFetchEXT(tex_3d, ivec3(coord, slice) >> level, level, texel));"
+        "return sparseTexelsResidentEXT(sparseTexelFetchEXT(tex, coord >> level, level, texel));"
+    "\n#else\n"
+        "return false;"
+    "\n#endif\n"
+    "}"
     "void main() {"
-        "ivec2 tex_size = textureSize(tex, 0);"
-        "ivec2 tex_coord = ivec2(gl_FragCoord.x + scroll_x, gl_FragCoord.y + scroll_y);"
-        "if(tex_coord.x > tex_size.x || tex_coord.y > tex_size.y ||"
+        "ivec2 size = tex_size(0).xy;"
+        "ivec2 tex_coord = ivec2((view_origin + view_matrix * gl_FragCoord.xy) * layer_scale);"
+        "if(tex_coord.x > size.x || tex_coord.y > size.y ||"
         "       tex_coord.x < 0 || tex_coord.y < 0) discard;"
-        "vec4 texel = vec4(0.0, 1.0, 1.0, 1.0);"
-        "int code = sparseTexelFetchEXT(tex, tex_coord, 0, texel);"
-        "if(sparseTexelsResidentEXT(code)) color = texel;"
-        "else color = vec4(1.0, 1.0, 0.0, 1.0);"
+        // fall back to the finest resident level, the mip tail always is
+        "color = missing_color;"
+        "for(int level = view_level; level < num_levels; ++level) {"
+            "vec4 texel = vec4(0.0, 1.0, 1.0, 1.0);"
+            "if(fetch(tex_coord, level, texel)) { color = texel; break; }"
+        "}"
+        // the level sampled at the zoom is the one wanted, tail pages are
+        // always resident
+        "ivec2 frag_coord = ivec2(gl_FragCoord.xy);"
+        "if(feedback_stride > 0 && frag_coord % feedback_stride == feedback_jitter &&"
+        "       view_level < tail_level) {"
+            "int level = view_level;"
+            "ivec3 pages = tex_size(level) / page_size;"
+            "ivec3 page = ivec3(tex_coord >> level, slice >> (tex_target == 2 ? level : 0)) / page_size;"
+            "if(page.x < pages.x && page.y < pages.y && page.z < pages.z)"
+                "atomicAdd(feedback[feedback_offset[level] +"
+                "    (page.z * pages.y + page.y) * pages.x + page.x], 1u);"
+        "}"
     "}";
 
 static int blockblit2d(
@@ -171,6 +519,163 @@ static int blockblit2d(
     return rows * cols;
 }
 
+static int blockblit3d(
+    const void *src, int src_pitch, int src_slice_pitch,
+    int src_x, int src_y, int src_z,
+    void *dst, int dst_pitch, int dst_slice_pitch,
+    int block_width, int block_height, int block_depth, int block_size,
+    int width, int height, int depth) {
+
+    int slices = depth / block_depth;
+
+    int blocks = 0;
+    for(int slice = 0; slice < slices; ++slice)
+        blocks += blockblit2d(
+            (const uint8_t*)src + (src_z/block_depth + slice)*src_slice_pitch, src_pitch,
+            src_x, src_y,
+            (uint8_t*)dst + slice*dst_slice_pitch, dst_pitch,
+            block_width, block_height, block_size,
+            width, height);
+
+    return blocks;
+}
+
+static int page_table_init(
+    struct page_table *table,
+    int pages_x, int pages_y, int pages_z,
+    int page_width, int page_height) {
+    table->pages_x = pages_x;
+    table->pages_y = pages_y;
+    table->pages_z = pages_z;
+    table->num_rows = pages_y * pages_z;
+    table->page_width = page_width;
+    table->page_height = page_height;
+
+    table->entries = (struct page_entry*)calloc(pages_x * table->num_rows, sizeof(struct page_entry));
+
+    return table->entries ? 0 : -1;
+}
+
+static void page_table_free(struct page_table *table) {
+    free(table->entries);
+    table->entries = NULL;
+}
+
+static struct page_entry *page_table_entry(const struct page_table *table, int page_x, int page_y) {
+    return &table->entries[page_y * table->pages_x + page_x];
+}
+
+static int page_table_state(const struct page_table *table, int page_x, int page_y) {
+    return __atomic_load_n(&page_table_entry(table, page_x, page_y)->state, __ATOMIC_ACQUIRE);
+}
+
+static void page_table_set_state(
+    struct page_table *table,
+    int page_x0, int page_y0,
+    int page_x1, int page_y1,
+    int state) {
+    for(int y = page_y0; y < page_y1; ++y)
+        for(int x = page_x0; x < page_x1; ++x)
+            __atomic_store_n(&page_table_entry(table, x, y)->state, state, __ATOMIC_RELEASE);
+}
+
+static void page_table_request(
+    struct page_table *table,
+    int page_x0, int page_y0,
+    int page_x1, int page_y1,
+    uint64_t frame_number, uint64_t request_time) {
+    for(int y = page_y0; y < page_y1; ++y) {
+        for(int x = page_x0; x < page_x1; ++x) {
+            struct page_entry *entry = page_table_entry(table, x, y);
+            entry->request_frame = frame_number;
+            entry->request_time = request_time;
+        }
+    }
+
+    page_table_set_state(table, page_x0, page_y0, page_x1, page_y1, PAGE_QUEUED);
+}
+
+static int page_table_match(const struct page_table *table, int page_x, int page_y, int state, int wanted) {
+    return page_table_state(table, page_x, page_y) == state &&
+        (!wanted || page_table_entry(table, page_x, page_y)->wanted);
+}
+
+// Find the first page in the given state inside the bounds and grow it into
+// a rectangle of at most max_pages pages, first to the right, then down.
+// If wanted is set, only pages marked wanted match.
+static int page_table_find_rect(
+    const struct page_table *table,
+    int state, int wanted,
+    int bound_x0, int bound_y0,
+    int bound_x1, int bound_y1,
+    int max_pages,
+    int *page_x0, int *page_y0,
+    int *page_x1, int *page_y1) {
+
+    for(int y = bound_y0; y < bound_y1; ++y) {
+        for(int x = bound_x0; x < bound_x1; ++x) {
+            if(!page_table_match(table, x, y, state, wanted))
+                continue;
+
+            int x1 = x + 1;
+            while(x1 < bound_x1 && x1 - x < max_pages &&
+                page_table_match(table, x1, y, state, wanted))
+                x1 += 1;
+
+            int y1 = y + 1;
+            while(y1 < bound_y1 && (y1 + 1 - y) * (x1 - x) <= max_pages) {
+                int row_matches = 1;
+                for(int xx = x; xx < x1 && row_matches; ++xx)
+                    row_matches = page_table_match(table, xx, y1, state, wanted);
+
+                if(!row_matches)
+                    break;
+
+                y1 += 1;
+            }
+
+            *page_x0 = x; *page_y0 = y;
+            *page_x1 = x1; *page_y1 = y1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Sweep the CLOCK hand over the table and mark unreferenced resident pages
+// that are not wanted for eviction until num_committed <= target.
+static int page_table_evict(
+    struct page_table *table,
+    int target,
+    uint64_t frame_number) {
+    int num_pages = table->pages_x * table->num_rows;
+
+    int evicted = 0;
+    for(int i = 0; i < 2 * num_pages && table->num_committed > target; ++i) {
+        int x = table->clock_hand % table->pages_x;
+        int y = table->clock_hand / table->pages_x;
+        table->clock_hand = (table->clock_hand + 1) % num_pages;
+
+        struct page_entry *entry = page_table_entry(table, x, y);
+        if(entry->wanted || page_table_state(table, x, y) != PAGE_RESIDENT)
+            continue;
+
+        if(entry->referenced) { // second chance
+            entry->referenced = 0;
+            continue;
+        }
+
+        entry->evict_frame = frame_number;
+        page_table_set_state(table, x, y, x+1, y+1, PAGE_EVICTING);
+        table->num_committed -= 1;
+        table->num_evicting += 1;
+        evicted += 1;
+    }
+
+    return evicted;
+}
+
 static int xfer_buffer_init(struct xfer_buffer *xfer_buffer, uint64_t xfer_size) {
     xfer_buffer->size = xfer_size;
     xfer_buffer->syncpt = 0;
@@ -195,171 +700,220 @@ static int xfer_buffer_init(struct xfer_buffer *xfer_buffer, uint64_t xfer_size)
 
     xfer_buffer->pbo_buffer = ptr;
 
-    glGenQueries(1, &xfer_buffer->timer_query);
-
     return 0;
 }
 
 static int xfer_start(
     struct xfer_buffer *xfer_buffer,
-    unsigned dst_tex,
+    unsigned dst_target, unsigned dst_tex,
     unsigned tex_format,
-    void *src_ptr, int src_pitch,
-    int src_x, int src_y,
-    int dst_x, int dst_y,
-    int block_width, int block_height, int block_size,
-    int width, int height,
+    void *src_ptr, int src_pitch, int src_slice_pitch,
+    int src_x, int src_y, int src_z,
+    int dst_x, int dst_y, int dst_z, int dst_level,
+    int block_width, int block_height, int block_depth, int block_size,
+    int page_width, int page_height, int page_depth,
+    int width, int height, int depth,
+    struct page_table *page_table,
+    uint64_t xfer_id,
     uint64_t start_frame) {
 
-    uint64_t size_bytes = width/block_width * height/block_height * block_size/8;
+    uint64_t size_bytes = (uint64_t)width/block_width * height/block_height * depth/block_depth * block_size/8;
 
-    assert(size_bytes < xfer_buffer->size);
+    assert(size_bytes <= xfer_buffer->size);
     assert(xfer_buffer->syncpt == 0);
 
+    xfer_buffer->dst_target = dst_target;
     xfer_buffer->dst_tex = dst_tex;
     xfer_buffer->tex_format = tex_format;
 
     xfer_buffer->src_ptr = src_ptr;
     xfer_buffer->src_pitch = src_pitch;
+    xfer_buffer->src_slice_pitch = src_slice_pitch;
 
-    xfer_buffer->src_x = src_x; xfer_buffer->src_y = src_y;
-    xfer_buffer->dst_x = dst_x; xfer_buffer->dst_y = dst_y;
+    xfer_buffer->src_x = src_x; xfer_buffer->src_y = src_y; xfer_buffer->src_z = src_z;
+    xfer_buffer->dst_x = dst_x; xfer_buffer->dst_y = dst_y; xfer_buffer->dst_z = dst_z;
+    xfer_buffer->dst_level = dst_level;
 
     xfer_buffer->block_width = block_width;
     xfer_buffer->block_height = block_height;
+    xfer_buffer->block_depth = block_depth;
     xfer_buffer->block_size = block_size;
+    xfer_buffer->page_width = page_width;
+    xfer_buffer->page_height = page_height;
+    xfer_buffer->page_depth = page_depth;
     xfer_buffer->width = width;
     xfer_buffer->height = height;
+    xfer_buffer->depth = depth;
+
+    xfer_buffer->page_table = page_table;
+    xfer_buffer->indirection = 0;
 
+    xfer_buffer->xfer_id = xfer_id;
     xfer_buffer->start_frame = start_frame;
+    xfer_buffer->start_time = time_ns();
 
     return 0;
 }
 
+static void xfer_buffer_set_page_state(struct xfer_buffer *xfer_buffer, int state) {
+    if(!xfer_buffer->page_table)
+        return;
+
+    // the source is in page table coordinates, atlas destinations are not
+    const struct page_table *table = xfer_buffer->page_table;
+    int page_x0 = xfer_buffer->src_x / xfer_buffer->page_width;
+    int row0 = (xfer_buffer->src_z / xfer_buffer->page_depth) * table->pages_y +
+        xfer_buffer->src_y / xfer_buffer->page_height;
+
+    page_table_set_state(xfer_buffer->page_table,
+        page_x0, row0,
+        page_x0 + xfer_buffer->width / xfer_buffer->page_width,
+        row0 + xfer_buffer->height / xfer_buffer->page_height,
+        state);
+}
+
 static int xfer_buffer_blit(struct xfer_buffer *xfer_buffer) {
     int dst_pitch = (xfer_buffer->width / xfer_buffer->block_width) * (xfer_buffer->block_size/8);
+    int dst_slice_pitch = (xfer_buffer->height / xfer_buffer->block_height) * dst_pitch;
 
-    blockblit2d(
-        xfer_buffer->src_ptr, xfer_buffer->src_pitch,
-        xfer_buffer->src_x, xfer_buffer->src_y,
-        xfer_buffer->pbo_buffer, dst_pitch,
-        xfer_buffer->block_width, xfer_buffer->block_height, (xfer_buffer->block_size/8),
-        xfer_buffer->width, xfer_buffer->height);
+    blockblit3d(
+        xfer_buffer->src_ptr, xfer_buffer->src_pitch, xfer_buffer->src_slice_pitch,
+        xfer_buffer->src_x, xfer_buffer->src_y, xfer_buffer->src_z,
+        xfer_buffer->pbo_buffer, dst_pitch, dst_slice_pitch,
+        xfer_buffer->block_width, xfer_buffer->block_height, xfer_buffer->block_depth,
+        (xfer_buffer->block_size/8),
+        xfer_buffer->width, xfer_buffer->height, xfer_buffer->depth);
 
     return 0;
 }
 
 static int xfer_buffer_upload(struct xfer_buffer *xfer_buffer) {
-    glBeginQueryIndexed(GL_TIME_ELAPSED, 0, xfer_buffer->timer_query);
+    unsigned target = xfer_buffer->dst_target;
 
-    glBindTexture(GL_TEXTURE_2D, xfer_buffer->dst_tex);
-    glTexPageCommitmentARB(
-        GL_TEXTURE_2D,
-        0, // XXX: dst_level
-        xfer_buffer->dst_x, xfer_buffer->dst_y, 0, // XXX: xfer_buffer->dst_z
-        xfer_buffer->width, xfer_buffer->height, 1, // XXX: xfer_buffer->depth
-        GL_TRUE);
+    glBindTexture(target, xfer_buffer->dst_tex);
+    if(!xfer_buffer->indirection)
+        glTexPageCommitmentARB(
+            target,
+            xfer_buffer->dst_level,
+            xfer_buffer->dst_x, xfer_buffer->dst_y, xfer_buffer->dst_z,
+            xfer_buffer->width, xfer_buffer->height, xfer_buffer->depth,
+            GL_TRUE);
 
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, xfer_buffer->pbo);
 
-    uint64_t bytes = xfer_buffer->width/xfer_buffer->block_width *
+    uint64_t bytes = (uint64_t)xfer_buffer->width/xfer_buffer->block_width *
         xfer_buffer->height/xfer_buffer->block_height *
+        xfer_buffer->depth/xfer_buffer->block_depth *
         xfer_buffer->block_size/8;
-    glCompressedTexSubImage2D(
-        GL_TEXTURE_2D,
-        0, // XXX: dst_level
-        xfer_buffer->dst_x, xfer_buffer->dst_y,
-        xfer_buffer->width,
-        xfer_buffer->height,
-        xfer_buffer->tex_format,
-        bytes,
-        NULL);
+    if(target == GL_TEXTURE_2D)
+        glCompressedTexSubImage2D(
+            target,
+            xfer_buffer->dst_level,
+            xfer_buffer->dst_x, xfer_buffer->dst_y,
+            xfer_buffer->width,
+            xfer_buffer->height,
+            xfer_buffer->tex_format,
+            bytes,
+            NULL);
+    else
+        glCompressedTexSubImage3D(
+            target,
+            xfer_buffer->dst_level,
+            xfer_buffer->dst_x, xfer_buffer->dst_y, xfer_buffer->dst_z,
+            xfer_buffer->width,
+            xfer_buffer->height,
+            xfer_buffer->depth,
+            xfer_buffer->tex_format,
+            bytes,
+            NULL);
 
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-    glEndQueryIndexed(GL_TIME_ELAPSED, 0);
-
-    GLbitfield fence_flags = 0; // must be zero
-    GLsync syncpt = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, fence_flags);
-
-    xfer_buffer->syncpt = syncpt;
+    // NOTE: same context as the page data, the fence covers both
+    if(xfer_buffer->indirection) {
+        glBindTexture(GL_TEXTURE_2D, xfer_buffer->indirection);
+        glTexSubImage2D(GL_TEXTURE_2D,
+            xfer_buffer->indirection_level,
+            xfer_buffer->indirection_x, xfer_buffer->indirection_y,
+            1, 1,
+            GL_RED_INTEGER, GL_UNSIGNED_INT,
+            &xfer_buffer->indirection_slot);
+    }
 
     return 0;
 }
 
-static int xfer_buffer_finish(
-    struct xfer_buffer *xfer_buffer,
-    int server_wait,
-    int client_wait, int flush, uint64_t client_timeout_ns) {
-    int status = 0;
-
-    if(client_wait) {
-        GLenum cond = glClientWaitSync(
-            xfer_buffer->syncpt,
-            flush ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
-            client_timeout_ns);
-
-        switch(cond) {
-            case GL_ALREADY_SIGNALED:
-            case GL_CONDITION_SATISFIED:
-                status = 1;
-                break;
+static int xfer_fence_status(GLsync syncpt) {
+    int sync_status = 0;
+    glGetSynciv(syncpt, GL_SYNC_STATUS, sizeof(int), NULL, &sync_status);
 
-            case GL_TIMEOUT_EXPIRED:
-                status = 0;
+    switch(sync_status) {
+        case GL_SIGNALED:
+            return 1;
 
-            case GL_WAIT_FAILED: // fall through
-            default:
-                status = -1;
-                break;
-        }
-    }
+        case GL_UNSIGNALED:
+            return 0;
 
-    if(server_wait) {
-        glWaitSync(xfer_buffer->syncpt, 0 /* must be zero */, GL_TIMEOUT_IGNORED);
+        default:
+            return -1;
     }
+}
 
-    if(!client_wait && status == 0) {
-        int sync_status = 0;
-        glGetSynciv(xfer_buffer->syncpt, GL_SYNC_STATUS, sizeof(int), NULL, &sync_status);
+static int xfer_buffer_free(struct xfer_buffer *xfer_buffer) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, xfer_buffer->pbo);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 
-        switch(sync_status) {
-            case GL_SIGNALED:
-                status = 1;
-                break;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &xfer_buffer->pbo);
 
-            case GL_UNSIGNALED:
-                status = 0;
-                break;
+    return 0;
+}
 
-            default:
-                status = -1;
-        }
-    }
+static int xfer_query_init(struct xfer_query_pool *pool) {
+    memset(pool, 0, sizeof(struct xfer_query_pool));
 
-    if(status == 1) {
-        glDeleteSync(xfer_buffer->syncpt);
-        xfer_buffer->syncpt = 0;
-    }
+    for(int i = 0; i < XFER_QUERY_POOL_SIZE; ++i)
+        glGenQueries(2, pool->queries[i].timestamps);
+
+    return 0;
+}
 
-    glGetQueryObjectui64v(xfer_buffer->timer_query, GL_QUERY_RESULT, &xfer_buffer->upload_time);
-    LOGI("**** BUFFER UPLOAD TIME: %llu", xfer_buffer->upload_time);
+static int xfer_query_free(struct xfer_query_pool *pool) {
+    for(int i = 0; i < XFER_QUERY_POOL_SIZE; ++i)
+        glDeleteQueries(2, pool->queries[i].timestamps);
 
-    return status;
+    return 0;
 }
 
-static int xfer_buffer_free(struct xfer_buffer *xfer_buffer) {
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, xfer_buffer->pbo);
-    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+static int xfer_query_begin(struct xfer_query_pool *pool, const struct xfer_buffer *xfer_buffer) {
+    int next = (pool->wr + 1) % XFER_QUERY_POOL_SIZE;
+    if(next == pool->rd)
+        return -1; // pool exhausted, skip timing rather than stall
 
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-    glDeleteBuffers(1, &xfer_buffer->pbo);
+    struct xfer_query *query = &pool->queries[pool->wr];
+    query->xfer_id = xfer_buffer->xfer_id;
+    query->num_pages = (xfer_buffer->width / xfer_buffer->page_width) *
+        (xfer_buffer->height / xfer_buffer->page_height) *
+        (xfer_buffer->depth / xfer_buffer->page_depth);
+    query->num_bytes = xfer_buffer->block_size/8 *
+        (xfer_buffer->width / xfer_buffer->block_width) *
+        (xfer_buffer->height / xfer_buffer->block_height) *
+        (xfer_buffer->depth / xfer_buffer->block_depth);
 
-    glDeleteSync(xfer_buffer->syncpt);
+    glQueryCounter(query->timestamps[0], GL_TIMESTAMP);
 
-    return 0;
+    return pool->wr;
 }
 
+static void xfer_query_end(struct xfer_query_pool *pool, int query_idx) {
+    if(query_idx < 0)
+        return;
+
+    glQueryCounter(pool->queries[query_idx].timestamps[1], GL_TIMESTAMP);
+    pool->wr = (query_idx + 1) % XFER_QUERY_POOL_SIZE;
+}
+
+
 static int xfer_queue_stop(struct xfer_queue *queue) {
     pthread_mutex_lock(&queue->queue_lock);
 
@@ -410,6 +964,7 @@ static int xfer_queue_get(
             }
 
             queue->queue_counters[queue_num][0] = rd;
+            trace_counter(xfer_queue_names[queue_num], (wr - rd + XFER_QUEUE_MAX_SIZE) % XFER_QUEUE_MAX_SIZE);
             break;
         }
     }
@@ -419,23 +974,31 @@ static int xfer_queue_get(
     return stopped ? -1 : got;
 }
 
-static int xfer_queue_put(struct xfer_queue *queue, int queue_num, int element) {
+static int xfer_queue_put_many(struct xfer_queue *queue, int queue_num, const int *elements, int num) {
     pthread_mutex_lock(&queue->queue_lock);
 
     int rd = queue->queue_counters[queue_num][0];
     int wr = queue->queue_counters[queue_num][1];
-    int next = (wr + 1) % XFER_QUEUE_MAX_SIZE;
     int stopped = queue->stopped;
 
     int result = 0;
-    if(!stopped && next != rd) { // queue not full
-        queue->queues[queue_num][wr] = element;
-        queue->queue_counters[queue_num][1] = next;
+    while(!stopped && result < num) {
+        int next = (wr + 1) % XFER_QUEUE_MAX_SIZE;
+        if(next == rd) // queue full
+            break;
+
+        queue->queues[queue_num][wr] = elements[result];
+        wr = next;
+
+        result += 1;
+    }
 
-        result = 1;
+    if(result > 0) {
+        queue->queue_counters[queue_num][1] = wr;
+        trace_counter(xfer_queue_names[queue_num], (wr - rd + XFER_QUEUE_MAX_SIZE) % XFER_QUEUE_MAX_SIZE);
 
         if(queue->queue_waiting[queue_num] > 0)
-            pthread_cond_signal(&queue->queue_not_empty[queue_num]);
+            pthread_cond_broadcast(&queue->queue_not_empty[queue_num]);
     }
 
     pthread_mutex_unlock(&queue->queue_lock);
@@ -443,14 +1006,36 @@ static int xfer_queue_put(struct xfer_queue *queue, int queue_num, int element)
     return stopped ? -1 : result;
 }
 
+static int xfer_queue_put(struct xfer_queue *queue, int queue_num, int element) {
+    return xfer_queue_put_many(queue, queue_num, &element, 1);
+}
+
+static int xfer_queue_size(struct xfer_queue *queue, int queue_num) {
+    pthread_mutex_lock(&queue->queue_lock);
+
+    int rd = queue->queue_counters[queue_num][0];
+    int wr = queue->queue_counters[queue_num][1];
+
+    pthread_mutex_unlock(&queue->queue_lock);
+
+    return (wr - rd + XFER_QUEUE_MAX_SIZE) % XFER_QUEUE_MAX_SIZE;
+}
+
 static void* xfer_thread_main(void *arg) {
     struct xfer *xfer = (struct xfer*)arg;
 
+    trace_thread_name("blit");
+
     int buffer_id = -1;
     while(xfer_queue_get(&xfer->queue, XFER_QUEUE_READ, 1, &buffer_id, 1) == 1) {
         LOGI("**** BLITTING BUFFER: %d", buffer_id);
         struct xfer_buffer *xfer_buffer = &xfer->buffers[buffer_id];
 
+        trace_begin("blit");
+        trace_flow_step("xfer", xfer_buffer->xfer_id);
+
+        xfer_buffer_set_page_state(xfer_buffer, PAGE_BLITTING);
+
         struct timespec time_start, time_end;
         clock_gettime(CLOCK_MONOTONIC, &time_start);
         xfer_buffer_blit(xfer_buffer);
@@ -461,28 +1046,42 @@ static void* xfer_thread_main(void *arg) {
             ((uint64_t)time_start.tv_sec * 1000000000 + time_start.tv_nsec);
 
         LOGI("**** BUFFER BLIT time: %llu", xfer_buffer->blit_time);
+        trace_end("blit");
 
         if(xfer_queue_put(&xfer->queue, XFER_QUEUE_UPLOAD, buffer_id) != 1)
             break;
+
+        // the upload thread is woken up by the queue itself
+        if(!xfer->upload_thread && xfer->notify)
+            xfer->notify(xfer->notify_data, 0);
     }
 
     return (void*)xfer;
 }
 
-static int xfer_init(struct xfer *xfer, int buffer_size) {
-    for(int i = 0; i < XFER_NUM_BUFFERS; ++i) {
-        LOGI("**** INIT BUFFER: %d / %d", i, XFER_NUM_BUFFERS);
+static int xfer_init(struct xfer *xfer, int buffer_size, int upload_thread) {
+    xfer->upload_thread = upload_thread;
+
+    // otherwise initialized on the upload context
+    if(!upload_thread)
+        xfer_query_init(&xfer->query_pool);
+
+    xfer->buffer_size = buffer_size;
+
+    for(int i = 0; i < XFER_MIN_BUFFERS; ++i) {
+        LOGI("**** INIT BUFFER: %d / %d", i, XFER_MIN_BUFFERS);
         if(xfer_buffer_init(&xfer->buffers[i], buffer_size) != 0)
             return 0;
     }
+    xfer->num_buffers = XFER_MIN_BUFFERS;
 
     for(int i = 0; i < XFER_NUM_QUEUES; ++i)
         for(int j = 0; j < XFER_QUEUE_MAX_SIZE; ++j)
             xfer->queue.queues[i][j] = -1;
 
-    for(int i = 0; i < XFER_NUM_BUFFERS; ++i) // initialize pending queue
+    for(int i = 0; i < XFER_MIN_BUFFERS; ++i) // initialize pending queue
         xfer->queue.queues[XFER_QUEUE_IDLE][i] = i;
-    xfer->queue.queue_counters[XFER_QUEUE_IDLE][1] = XFER_NUM_BUFFERS;
+    xfer->queue.queue_counters[XFER_QUEUE_IDLE][1] = XFER_MIN_BUFFERS;
 
     for(int i = 0; i < XFER_NUM_THREADS; ++i)
         pthread_create(&xfer->threads[i], NULL, xfer_thread_main, (void*)xfer);
@@ -490,6 +1089,40 @@ static int xfer_init(struct xfer *xfer, int buffer_size) {
     return 0;
 }
 
+static int xfer_query_poll(struct xfer *xfer) {
+    struct xfer_query_pool *pool = &xfer->query_pool;
+
+    int num_results = 0;
+    while(pool->rd != pool->wr) {
+        struct xfer_query *query = &pool->queries[pool->rd];
+
+        // queries complete in order, stop at the first one still in flight
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(query->timestamps[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+            break;
+
+        uint64_t time_start = 0, time_end = 0;
+        glGetQueryObjectui64v(query->timestamps[0], GL_QUERY_RESULT, &time_start);
+        glGetQueryObjectui64v(query->timestamps[1], GL_QUERY_RESULT, &time_end);
+
+        uint64_t upload_time = time_end - time_start;
+        LOGI("**** TRANSFER %llu UPLOAD TIME: %llu", query->xfer_id, upload_time);
+
+        if(query->num_pages > 0) {
+            xfer->upload_times[xfer->upload_idx] = upload_time / query->num_pages;
+            xfer->upload_idx = (xfer->upload_idx + 1) % XFER_BENCHMARK_SIZE;
+        }
+        xfer->upload_bytes += query->num_bytes;
+        xfer->upload_nsec += upload_time;
+
+        pool->rd = (pool->rd + 1) % XFER_QUERY_POOL_SIZE;
+        num_results += 1;
+    }
+
+    return num_results;
+}
+
 static int xfer_free(struct xfer *xfer) {
     xfer_queue_stop(&xfer->queue);
 
@@ -501,24 +1134,123 @@ static int xfer_free(struct xfer *xfer) {
             err = -1;
     }
 
-    for(int i = 0; i < XFER_NUM_BUFFERS; ++i)
+    for(int i = 0; i < xfer->num_buffers; ++i) {
+        GLsync syncpt = xfer->buffers[i].syncpt;
+        if(!syncpt)
+            continue;
+
+        // a fence is shared by all buffers uploaded in the same frame
+        for(int j = i; j < xfer->num_buffers; ++j)
+            if(xfer->buffers[j].syncpt == syncpt)
+                xfer->buffers[j].syncpt = 0;
+        glDeleteSync(syncpt);
+    }
+
+    for(int i = 0; i < xfer->num_buffers; ++i)
         xfer_buffer_free(&xfer->buffers[i]);
 
+    if(xfer->release_syncpt)
+        glDeleteSync(xfer->release_syncpt);
+
+    if(!xfer->upload_thread) {
+        xfer_query_poll(xfer);
+        xfer_query_free(&xfer->query_pool);
+    }
+
     return err;
 }
 
+// Bytes that can be uploaded before the present deadline at the measured
+// throughput. Unlimited without a measurement or a frame in progress.
+static int64_t xfer_upload_budget(const struct xfer *xfer, uint64_t now) {
+    uint64_t deadline = __atomic_load_n(&xfer->upload_deadline, __ATOMIC_RELAXED);
+    if(deadline == 0 || now >= deadline || xfer->upload_nsec == 0)
+        return INT64_MAX;
+
+    if(now + XFER_DEADLINE_MARGIN >= deadline)
+        return 0;
+
+    return (double)(deadline - XFER_DEADLINE_MARGIN - now) *
+        xfer->upload_bytes / xfer->upload_nsec;
+}
+
+static uint64_t xfer_buffer_bytes(const struct xfer_buffer *xfer_buffer) {
+    return (uint64_t)xfer_buffer->width/xfer_buffer->block_width *
+        xfer_buffer->height/xfer_buffer->block_height *
+        xfer_buffer->depth/xfer_buffer->block_depth *
+        xfer_buffer->block_size/8;
+}
+
 static int xfer_upload(struct xfer *xfer, int wait) {
     int queue[XFER_QUEUE_MAX_SIZE];
-    int num = xfer_queue_get(&xfer->queue, XFER_QUEUE_UPLOAD, wait,  queue, XFER_QUEUE_MAX_SIZE);
+    int num = xfer_queue_get(&xfer->queue, XFER_QUEUE_UPLOAD, wait,  queue, 1);
+
+    // released pages may be among these, don't overtake their uncommit
+    GLsync release_syncpt = __atomic_exchange_n(&xfer->release_syncpt, 0, __ATOMIC_ACQ_REL);
+    if(release_syncpt) {
+        glWaitSync(release_syncpt, 0 /* must be zero */, GL_TIMEOUT_IGNORED);
+        glDeleteSync(release_syncpt);
+    }
+
+    // collect timings of earlier uploads without waiting for the GPU
+    xfer_query_poll(xfer);
+
+    // take more while they fit in the time left in this frame, at least
+    // one buffer is uploaded to keep streaming
+    int64_t budget = 0;
+    if(num == 1) {
+        uint64_t now = time_ns();
+        budget = xfer_upload_budget(xfer, now);
+        budget -= MIN(budget, (int64_t)xfer_buffer_bytes(&xfer->buffers[queue[0]]));
+
+        while(budget > 0 && num < XFER_QUEUE_MAX_SIZE &&
+            xfer_queue_get(&xfer->queue, XFER_QUEUE_UPLOAD, 0, &queue[num], 1) == 1) {
+            budget -= MIN(budget, (int64_t)xfer_buffer_bytes(&xfer->buffers[queue[num]]));
+            num += 1;
+        }
+    }
 
     for(int i = 0; i < num; ++i) {
         int buffer_id = queue[i];
         struct xfer_buffer *xfer_buffer = &xfer->buffers[buffer_id];
 
         LOGI("**** UPLOADING BUFFER: %d", buffer_id);
+        trace_begin("upload");
+        trace_flow_step("xfer", xfer_buffer->xfer_id);
+
+        xfer_buffer_set_page_state(xfer_buffer, PAGE_UPLOADING);
+
+        int query = xfer_query_begin(&xfer->query_pool, xfer_buffer);
         xfer_buffer_upload(xfer_buffer);
+        xfer_query_end(&xfer->query_pool, query);
+
+        trace_end("upload");
+    }
+
+    if(num > 0) {
+        // one fence for all uploads issued in this frame
+        GLbitfield fence_flags = 0; // must be zero
+        GLsync syncpt = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, fence_flags);
 
-        xfer_queue_put(&xfer->queue, XFER_QUEUE_WAIT, buffer_id);
+        for(int i = 0; i < num; ++i)
+            xfer->buffers[queue[i]].syncpt = syncpt;
+
+        // fences must be flushed before another context can wait on them
+        if(xfer->upload_thread)
+            glFlush();
+
+        // publish the whole batch at once so it is retired together
+        xfer_queue_put_many(&xfer->queue, XFER_QUEUE_WAIT, queue, num);
+
+        if(xfer->upload_thread && xfer->notify)
+            xfer->notify(xfer->notify_data, 1);
+
+        // the rest goes after the frame is presented
+        uint64_t deadline = __atomic_load_n(&xfer->upload_deadline, __ATOMIC_RELAXED);
+        if(xfer->upload_thread && budget == 0 && time_ns() < deadline) {
+            struct timespec timeout = { deadline / 1000000000, deadline % 1000000000 };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &timeout, NULL);
+        }
     }
 
     return num;
@@ -528,257 +1260,1436 @@ static int xfer_finish(struct xfer *xfer, uint64_t frame_number) {
     int queue[XFER_QUEUE_MAX_SIZE];
     int num = xfer_queue_get(&xfer->queue, XFER_QUEUE_WAIT, 0, queue, XFER_QUEUE_MAX_SIZE);
 
-    int num_finished = 0;
     for(int i = 0; i < num; ++i) {
-        int buffer_id = queue[i];
+        xfer->retire[xfer->retire_wr] = queue[i];
+        xfer->retire_wr = (xfer->retire_wr + 1) % XFER_QUEUE_MAX_SIZE;
+    }
+
+    int num_finished = 0;
+    GLsync signaled = 0;
+    xfer->num_resident = 0;
+    while(xfer->retire_rd != xfer->retire_wr) {
+        int buffer_id = xfer->retire[xfer->retire_rd];
         struct xfer_buffer *xfer_buffer = &xfer->buffers[buffer_id];
 
-        int num_pages = (xfer_buffer->width / 512) *
-            (xfer_buffer->height / 512);
+        if(xfer_buffer->syncpt != signaled) {
+            // retire in order, stop at the first fence not signaled yet
+            if(xfer_fence_status(xfer_buffer->syncpt) == 0)
+                break;
+
+            if(signaled) // previous frame's uploads are all retired
+                glDeleteSync(signaled);
+            signaled = xfer_buffer->syncpt;
+        }
+
+        int num_pages = (xfer_buffer->width / xfer_buffer->page_width) *
+            (xfer_buffer->height / xfer_buffer->page_height) *
+            (xfer_buffer->depth / xfer_buffer->page_depth);
         uint64_t num_bytes = xfer_buffer->block_size/8 *
             (xfer_buffer->width / xfer_buffer->block_width) *
-            (xfer_buffer->height / xfer_buffer->block_height);
+            (xfer_buffer->height / xfer_buffer->block_height) *
+            (xfer_buffer->depth / xfer_buffer->block_depth);
 
         uint64_t latency_frames = frame_number - xfer_buffer->start_frame;
         int latency_idx = latency_frames >= XFER_BENCHMARK_HISTOGRAM ?
             XFER_BENCHMARK_HISTOGRAM-1 : latency_frames;
         xfer->latency_histogram[latency_idx] += 1;
 
-        xfer->upload_times[xfer->upload_idx] = xfer_buffer->upload_time / num_pages;
-        xfer->upload_idx = (xfer->upload_idx + 1) % XFER_BENCHMARK_SIZE;
-        xfer->upload_bytes += num_bytes;
-        xfer->upload_nsec += xfer_buffer->upload_time;
+        uint64_t latency = time_ns() - xfer_buffer->start_time;
+        xfer->resident_latency = xfer->resident_latency == 0 ? latency :
+            (xfer->resident_latency * (XFER_LATENCY_AVERAGE-1) + latency) / XFER_LATENCY_AVERAGE;
 
         xfer->blit_times[xfer->blit_idx] = xfer_buffer->blit_time / num_pages;
         xfer->blit_idx = (xfer->blit_idx + 1) % XFER_BENCHMARK_SIZE;
         xfer->blit_bytes += num_bytes;
         xfer->blit_nsec += xfer_buffer->blit_time;
 
-        int finished = xfer_buffer_finish(xfer_buffer, 1, 0, 0, 0);
-        if(finished) {
-            xfer_queue_put(&xfer->queue, XFER_QUEUE_IDLE, buffer_id);
-            num_finished += 1;
-        } else {
-            xfer_queue_put(&xfer->queue, XFER_QUEUE_WAIT, buffer_id);
+        xfer_buffer_set_page_state(xfer_buffer, PAGE_RESIDENT);
+
+        trace_begin("retire");
+        trace_flow_end("xfer", xfer_buffer->xfer_id);
+        trace_end("retire");
+
+        if(xfer_buffer->page_table) {
+            struct xfer_resident *resident = &xfer->resident[xfer->num_resident++];
+            resident->page_table = xfer_buffer->page_table;
+            resident->x0 = xfer_buffer->src_x;
+            resident->y0 = xfer_buffer->src_y;
+            resident->x1 = xfer_buffer->src_x + xfer_buffer->width;
+            resident->y1 = xfer_buffer->src_y + xfer_buffer->height;
         }
+
+        xfer_buffer->syncpt = 0;
+        xfer->retire_rd = (xfer->retire_rd + 1) % XFER_QUEUE_MAX_SIZE;
+
+        xfer_queue_put(&xfer->queue, XFER_QUEUE_IDLE, buffer_id);
+        num_finished += 1;
+    }
+
+    // the painter only waits once pages committed on the upload context are
+    // made resident, fences there signal in order so the newest one covers
+    // the others
+    if(signaled) {
+        if(xfer->upload_thread)
+            glWaitSync(signaled, 0 /* must be zero */, GL_TIMEOUT_IGNORED);
+        glDeleteSync(signaled);
     }
 
     return num_finished;
 }
 
-static int gfx_page_commit(struct gfx *gfx, int page_x, int page_y) {
-    int level = 0;
+static int xfer_pool_grow(struct xfer *xfer) {
+    int buffer_id = xfer->num_buffers;
+    if(buffer_id >= XFER_MAX_BUFFERS ||
+        (uint64_t)(buffer_id + 1) * xfer->buffer_size > XFER_POOL_MAX_BYTES)
+        return -1;
 
-    glTexPageCommitmentARB(
-        GL_TEXTURE_2D,
-        level,
-        page_x * gfx->page_width, page_y * gfx->page_height, 0,
-        gfx->page_width, gfx->page_height, gfx->page_depth,
-        GL_TRUE);
+    LOGI("**** GROW BUFFER POOL: %d", buffer_id + 1);
+    if(xfer_buffer_init(&xfer->buffers[buffer_id], xfer->buffer_size) != 0)
+        return -1;
 
-    const void *texptr = texmmap_ptr(gfx->texmmap);
-    const uint64_t header_size = 16;
-    const char *ptr = (const char *)texptr + header_size;
+    // created on the painter context, flushed before the upload context
+    // can take it from the idle queue
+    if(xfer->upload_thread)
+        glFlush();
 
-    char pagebuffer[64*1024];
-    int src_pitch = (gfx->tex_width/gfx->block_width) * (gfx->block_size/8);
-    int dst_pitch = (512/8) * (gfx->block_size/8);
+    xfer->num_buffers += 1;
 
-    blockblit2d(ptr, src_pitch,
-        page_x * gfx->page_width, page_y * gfx->page_height,
-        pagebuffer, dst_pitch,
-        gfx->block_width, gfx->block_height, (gfx->block_size/8),
-        gfx->page_width, gfx->page_height);
+    return xfer_queue_put(&xfer->queue, XFER_QUEUE_IDLE, buffer_id) == 1 ? 0 : -1;
+}
+
+static int xfer_pool_shrink(struct xfer *xfer) {
+    int buffer_id = xfer->num_buffers - 1;
+    if(buffer_id < XFER_MIN_BUFFERS)
+        return -1;
+
+    // only the painter takes idle buffers, so the idle queue can be
+    // drained to pull out the last buffer in the pool
+    int idle[XFER_QUEUE_MAX_SIZE];
+    int num_idle = xfer_queue_get(&xfer->queue, XFER_QUEUE_IDLE, 0, idle, XFER_QUEUE_MAX_SIZE);
+    if(num_idle < 0)
+        return -1;
+
+    int found = 0;
+    for(int i = 0; i < num_idle; ++i) {
+        if(idle[i] == buffer_id) {
+            idle[i] = idle[num_idle-1];
+            num_idle -= 1;
+            found = 1;
+            break;
+        }
+    }
+
+    xfer_queue_put_many(&xfer->queue, XFER_QUEUE_IDLE, idle, num_idle);
+
+    if(!found)
+        return -1;
 
-    glCompressedTexSubImage2D(
-        GL_TEXTURE_2D,
-        level,
-        page_x * gfx->page_width, page_y * gfx->page_height,
-        gfx->page_width, gfx->page_height,
-        gfx->tex_format, 64*1024,
-        pagebuffer);
+    LOGI("**** SHRINK BUFFER POOL: %d", buffer_id);
+    xfer_buffer_free(&xfer->buffers[buffer_id]);
+    xfer->num_buffers -= 1;
 
     return 0;
 }
 
-static int gfx_page_uncommit(struct gfx *gfx, int page_x, int page_y) {
-    int level = 0;
+// Shrink the pool if it stayed idle long enough. Returns the time until the
+// next buffer may go, 0 if busy or at the minimum.
+static uint64_t xfer_pool_trim(struct xfer *xfer, uint64_t now) {
+    if(xfer->num_buffers <= XFER_MIN_BUFFERS ||
+        xfer_queue_size(&xfer->queue, XFER_QUEUE_IDLE) != xfer->num_buffers) {
+        xfer->idle_since = 0;
+        return 0;
+    }
 
-    glTexPageCommitmentARB(
-        GL_TEXTURE_2D,
-        level,
-        page_x * gfx->page_width, page_y * gfx->page_height, 0,
-        gfx->page_width, gfx->page_height, gfx->page_depth,
-        GL_FALSE);
+    if(xfer->idle_since == 0)
+        xfer->idle_since = now;
 
-    return 0;
+    if(now - xfer->idle_since >= XFER_POOL_SHRINK_TIME) {
+        if(xfer_pool_shrink(xfer) != 0 || xfer->num_buffers <= XFER_MIN_BUFFERS) {
+            xfer->idle_since = 0;
+            return 0;
+        }
+        xfer->idle_since = now;
+    }
+
+    return xfer->idle_since + XFER_POOL_SHRINK_TIME - now;
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+static int xfer_pool_update(struct xfer *xfer, uint64_t frame_number) {
+    // starvation must be repeated on consecutive frames to grow the pool
+    if(xfer->starved_frame + 1 < frame_number)
+        xfer->starved_frames = 0;
 
-static int gfx_request_pages(
+    xfer_pool_trim(xfer, time_ns());
+
+    return xfer->num_buffers;
+}
+
+static int xfer_acquire(struct xfer *xfer, int wait, uint64_t frame_number, int *buffer_id) {
+    int ret = xfer_queue_get(&xfer->queue, XFER_QUEUE_IDLE, 0, buffer_id, 1);
+    if(ret != 0)
+        return ret;
+
+    if(xfer->starved_frame != frame_number) {
+        xfer->starved_frame = frame_number;
+        xfer->starved_frames += 1;
+    }
+
+    if(xfer->starved_frames >= XFER_POOL_GROW_FRAMES && xfer_pool_grow(xfer) == 0)
+        return xfer_queue_get(&xfer->queue, XFER_QUEUE_IDLE, 0, buffer_id, 1);
+
+    return wait ? xfer_queue_get(&xfer->queue, XFER_QUEUE_IDLE, 1, buffer_id, 1) : 0;
+}
+
+static int gfx_layer_page_bytes(const struct gfx_layer *layer) {
+    return (layer->page_width / layer->block_width) *
+        (layer->page_height / layer->block_height) *
+        (layer->page_depth / layer->block_depth) *
+        layer->block_size/8;
+}
+
+// Page z of a level, 3D textures halve the depth, array layers stay.
+static int gfx_layer_page_z(const struct gfx_layer *layer, int level, int slice) {
+    if(layer->target == GL_TEXTURE_3D)
+        slice >>= level;
+
+    return slice / layer->page_depth;
+}
+
+// Atlas pages are copied one at a time into a free slot, uncommitting
+// clears the indirection and returns the slot.
+static int gfx_request_atlas_pages(
     struct gfx *gfx,
+    struct gfx_layer *layer,
     int commit,
+    int level,
     int page_x0, int page_y0,
     int page_x1, int page_y1,
     int wait,
     uint64_t frame_number) {
+    struct page_table *table = &layer->page_tables[level];
+    const struct gfx_level *src_level = &layer->levels[level];
 
-    page_x1 = MIN(page_x1, gfx->tex_width / gfx->page_width);
-    page_y1 = MIN(page_y1, gfx->tex_height / gfx->page_height);
+    for(int y = page_y0; y < page_y1; ++y) {
+        for(int x = page_x0; x < page_x1; ++x) {
+            struct page_entry *entry = page_table_entry(table, x, y);
 
-    if(page_x1 <= page_x0 || page_y1 <= page_y0) // empty range
-        return 1;
+            if(!commit) {
+                uint32_t zero = 0;
+                glBindTexture(GL_TEXTURE_2D, layer->indirection);
+                glTexSubImage2D(GL_TEXTURE_2D, level, x, y, 1, 1,
+                    GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
 
-    int page_bytes = (gfx->page_width / gfx->block_width) *
-        (gfx->page_height / gfx->block_height) *
-        gfx->block_size/8;
-    if((page_x1-page_x0) * (page_y1-page_y0) * page_bytes >
-        XFER_BUFFER_SIZE) {
-        // XXX: this request is too large to fit in
+                // NOTE: frames that sampled the slot have finished
+                layer->free_slots[layer->num_free_slots++] = entry->slot;
+                entry->slot = 0;
+
+                page_table_set_state(table, x, y, x+1, y+1, PAGE_ABSENT);
+                continue;
+            }
+
+            if(layer->num_free_slots == 0)
+                return 0;
+
+            int buffer_id = -1;
+            int ret = xfer_acquire(&gfx->xfer, wait, frame_number, &buffer_id);
+            if(ret != 1) return ret;
+
+            uint32_t slot = layer->free_slots[--layer->num_free_slots];
+            int atlas_x = (slot-1) % layer->atlas_pages_x, atlas_y = (slot-1) / layer->atlas_pages_x;
+            entry->slot = slot;
+
+            struct xfer_buffer *xfer_buffer = &gfx->xfer.buffers[buffer_id];
+            xfer_start(
+                xfer_buffer,
+                GL_TEXTURE_2D, layer->texture, layer->tex_format,
+                (void*)src_level->data, src_level->src_pitch, src_level->src_slice_pitch,
+                x * layer->page_width, y * layer->page_height, 0,
+                atlas_x * layer->page_width, atlas_y * layer->page_height, 0,
+                0,
+                layer->block_width, layer->block_height, 1, layer->block_size,
+                layer->page_width, layer->page_height, 1,
+                layer->page_width, layer->page_height, 1,
+                table,
+                gfx->xfer.next_xfer_id++,
+                frame_number);
+
+            xfer_buffer->indirection = layer->indirection;
+            xfer_buffer->indirection_x = x;
+            xfer_buffer->indirection_y = y;
+            xfer_buffer->indirection_level = level;
+            xfer_buffer->indirection_slot = slot;
+
+            page_table_request(table, x, y, x+1, y+1, frame_number, time_ns());
+            table->num_committed += 1;
+
+            trace_flow_begin("xfer", xfer_buffer->xfer_id);
+            if(xfer_queue_put(&gfx->xfer.queue, XFER_QUEUE_READ, buffer_id) != 1)
+                return -1;
+        }
     }
 
-    LOGI("**** %s  (%d, %d) -> (%d, %d)  frame: %llu",
+    return 1;
+}
+
+// Commit or uncommit a rectangle of table rows inside one slice of pages.
+static int gfx_request_pages(
+    struct gfx *gfx,
+    struct gfx_layer *layer,
+    int commit,
+    int level,
+    int page_x0, int row0,
+    int page_x1, int row1,
+    int wait,
+    uint64_t frame_number) {
+    struct page_table *table = &layer->page_tables[level];
+
+    page_x1 = MIN(page_x1, table->pages_x);
+    row1 = MIN(row1, table->num_rows);
+
+    if(page_x1 <= page_x0 || row1 <= row0) // empty range
+        return 1;
+
+    int page_z = row0 / table->pages_y;
+    int page_y0 = row0 % table->pages_y;
+    int page_y1 = page_y0 + (row1 - row0);
+    assert(page_y1 <= table->pages_y);
+
+    LOGI("**** %s  layer %d  level %d  (%d, %d, %d) -> (%d, %d)  frame: %llu",
         commit ? "COMMIT" : "UNCOMMIT",
-        page_x0, page_y0, page_x1, page_y1,
+        (int)(layer - gfx->layers), level, page_x0, page_y0, page_z, page_x1, page_y1,
         frame_number);
 
+    if(layer->indirection)
+        return gfx_request_atlas_pages(gfx, layer, commit, level,
+            page_x0, row0, page_x1, row1,
+            wait, frame_number);
+
     if(commit) {
         int buffer_id = -1;
-        int ret = xfer_queue_get(&gfx->xfer.queue, XFER_QUEUE_IDLE, wait, &buffer_id, 1);
+        int ret = xfer_acquire(&gfx->xfer, wait, frame_number, &buffer_id);
         if(ret != 1) return ret;
 
         struct xfer_buffer *xfer_buffer = &gfx->xfer.buffers[buffer_id];
 
-        int src_pitch = (gfx->tex_width/gfx->block_width) * (gfx->block_size/8);
+        const struct gfx_level *src_level = &layer->levels[level];
         xfer_start(
             xfer_buffer,
-            gfx->texture, gfx->tex_format,
-            texmmap_ptr(gfx->texmmap), src_pitch,
-            page_x0 * gfx->page_width, page_y0 * gfx->page_height,
-            page_x0 * gfx->page_width, page_y0 * gfx->page_height,
-            gfx->block_width, gfx->block_height, gfx->block_size,
-            (page_x1 - page_x0) * gfx->page_width,
-            (page_y1 - page_y0) * gfx->page_height,
+            layer->target, layer->texture, layer->tex_format,
+            (void*)src_level->data, src_level->src_pitch, src_level->src_slice_pitch,
+            page_x0 * layer->page_width, page_y0 * layer->page_height, page_z * layer->page_depth,
+            page_x0 * layer->page_width, page_y0 * layer->page_height, page_z * layer->page_depth,
+            level,
+            layer->block_width, layer->block_height, layer->block_depth, layer->block_size,
+            layer->page_width, layer->page_height, layer->page_depth,
+            (page_x1 - page_x0) * layer->page_width,
+            (page_y1 - page_y0) * layer->page_height,
+            layer->page_depth,
+            table,
+            gfx->xfer.next_xfer_id++,
             frame_number);
 
+        page_table_request(table,
+            page_x0, row0, page_x1, row1,
+            frame_number, time_ns());
+        table->num_committed += (page_x1 - page_x0) * (row1 - row0);
+
+        trace_flow_begin("xfer", xfer_buffer->xfer_id);
         if(xfer_queue_put(&gfx->xfer.queue, XFER_QUEUE_READ, buffer_id) != 1)
             return -1;
 
         return 1;
     } else {
-        int level = 0;
-
-        glBindTexture(GL_TEXTURE_2D, gfx->texture);
+        glBindTexture(layer->target, layer->texture);
         glTexPageCommitmentARB(
-            GL_TEXTURE_2D,
+            layer->target,
             level,
-            page_x0 * gfx->page_width, page_y0 * gfx->page_height, 0,
-            (page_x1 - page_x0) * gfx->page_width,
-            (page_y1 - page_y0) * gfx->page_height,
-            0 * gfx->page_depth,
+            page_x0 * layer->page_width, page_y0 * layer->page_height, page_z * layer->page_depth,
+            (page_x1 - page_x0) * layer->page_width,
+            (page_y1 - page_y0) * layer->page_height,
+            layer->page_depth,
             GL_FALSE);
 
+        page_table_set_state(table,
+            page_x0, row0, page_x1, row1,
+            PAGE_ABSENT);
+
         return 1;
     }
 }
 
-static int gfx_request_rect(
+static int gfx_num_evicting(const struct gfx *gfx) {
+    int num_evicting = 0;
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        const struct gfx_layer *layer = &gfx->layers[i];
+        for(int level = 0; level < layer->num_sparse_levels; ++level)
+            num_evicting += layer->page_tables[level].num_evicting;
+    }
+
+    return num_evicting;
+}
+
+static void gfx_frame_fence(struct gfx *gfx, uint64_t frame_number) {
+    // only needed while evicted pages wait to be uncommitted
+    if(gfx_num_evicting(gfx) == 0)
+        return;
+
+    // ring full, the newest fence is replaced, this one covers its frame too
+    int next = (gfx->fence_wr + 1) % GFX_MAX_FRAME_FENCES;
+    if(next == gfx->fence_rd) {
+        next = gfx->fence_wr;
+        gfx->fence_wr = (gfx->fence_wr + GFX_MAX_FRAME_FENCES - 1) % GFX_MAX_FRAME_FENCES;
+        glDeleteSync(gfx->frame_fences[gfx->fence_wr]);
+    }
+
+    GLbitfield fence_flags = 0; // must be zero
+    gfx->frame_fences[gfx->fence_wr] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, fence_flags);
+    gfx->fence_frames[gfx->fence_wr] = frame_number;
+    gfx->fence_wr = next;
+}
+
+static int gfx_release_pages(struct gfx *gfx, int wait, uint64_t frame_number) {
+    uint64_t completed_frames = gfx->completed_frames;
+    while(gfx->fence_rd != gfx->fence_wr) {
+        GLsync syncpt = gfx->frame_fences[gfx->fence_rd];
+        if(xfer_fence_status(syncpt) == 0)
+            break;
+
+        glDeleteSync(syncpt);
+        completed_frames = gfx->fence_frames[gfx->fence_rd] + 1;
+        gfx->fence_rd = (gfx->fence_rd + 1) % GFX_MAX_FRAME_FENCES;
+    }
+
+    if(completed_frames == gfx->completed_frames || gfx_num_evicting(gfx) == 0) {
+        gfx->completed_frames = completed_frames;
+        return 0;
+    }
+    gfx->completed_frames = completed_frames;
+
+    int released = 0;
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        struct gfx_layer *layer = &gfx->layers[i];
+
+        for(int level = 0; level < layer->num_sparse_levels; ++level) {
+            struct page_table *table = &layer->page_tables[level];
+
+            // collect pages no frame in flight can sample anymore
+            int level_released = 0;
+            for(int y = 0; y < table->num_rows; ++y) {
+                for(int x = 0; x < table->pages_x; ++x) {
+                    if(page_table_state(table, x, y) != PAGE_EVICTING ||
+                        page_table_entry(table, x, y)->evict_frame >= completed_frames)
+                        continue;
+
+                    page_table_set_state(table, x, y, x+1, y+1, PAGE_RELEASING);
+                    level_released += 1;
+                }
+            }
+            table->num_evicting -= level_released;
+            released += level_released;
+
+            // uncommit in as few rectangles as possible
+            for(int z = 0; z < table->pages_z; ++z) {
+                int x0, y0, x1, y1;
+                while(page_table_find_rect(table, PAGE_RELEASING, 0,
+                        0, z * table->pages_y, table->pages_x, (z+1) * table->pages_y,
+                        table->pages_x * table->pages_y,
+                        &x0, &y0, &x1, &y1))
+                    gfx_request_pages(gfx, layer, 0, level, x0, y0, x1, y1, wait, frame_number);
+            }
+        }
+    }
+
+    // the upload context may get the same pages again in this update, its
+    // commits and indirection writes have to land after these
+    if(released > 0 && gfx->xfer.upload_thread) {
+        GLbitfield fence_flags = 0; // must be zero
+        GLsync syncpt = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, fence_flags);
+        glFlush();
+
+        // NOTE: a fence not taken yet is covered by the newer one
+        GLsync older = __atomic_exchange_n(&gfx->xfer.release_syncpt, syncpt, __ATOMIC_ACQ_REL);
+        if(older)
+            glDeleteSync(older);
+    }
+
+    return released;
+}
+
+// Clear pages wanted at the given priority or below.
+static void gfx_clear_wanted(struct gfx *gfx, int wanted) {
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        struct gfx_layer *layer = &gfx->layers[i];
+
+        for(int level = 0; level < layer->num_sparse_levels; ++level) {
+            struct page_table *table = &layer->page_tables[level];
+            for(int j = 0; j < table->pages_x * table->num_rows; ++j) {
+                if(table->entries[j].wanted > wanted)
+                    continue;
+
+                table->entries[j].wanted = PAGE_WANTED_NONE;
+                table->entries[j].hits = 0;
+            }
+        }
+    }
+}
+
+// Mark a page wanted, and its ancestors on coarser levels so missing detail
+// falls back to a blurrier level instead of a hole.
+static void gfx_want_page(
+    struct gfx_layer *layer,
+    int wanted,
+    int level,
+    int page_x, int page_y, int page_z,
+    uint32_t hits) {
+    for(; level < layer->num_sparse_levels; ++level, page_x /= 2, page_y /= 2) {
+        struct page_table *table = &layer->page_tables[level];
+        if(page_x >= table->pages_x || page_y >= table->pages_y || page_z >= table->pages_z)
+            break;
+
+        struct page_entry *entry = page_table_entry(table, page_x, page_z * table->pages_y + page_y);
+        entry->wanted = MAX(entry->wanted, wanted);
+        entry->hits += hits;
+
+        if(layer->target == GL_TEXTURE_3D) // slices halve too
+            page_z /= 2;
+    }
+}
+
+// Horizontal extent of the convex hull of points between rows y0 and y1,
+// returns 0 if the hull misses the rows. Hull edges are among the segments
+// between any two points, the rest lie inside.
+static int hull_row_span(
+    const float points[][2], int num_points,
+    float y0, float y1,
+    float *x0, float *x1) {
+    int found = 0;
+    for(int i = 0; i < num_points; ++i) {
+        for(int j = i; j < num_points; ++j) {
+            float ax = points[i][0], ay = points[i][1];
+            float bx = points[j][0], by = points[j][1];
+            if(MAX(ay, by) < y0 || MIN(ay, by) > y1)
+                continue;
+
+            // clip the segment to the rows
+            float xa = ax, xb = bx;
+            if(ay != by) {
+                float ta = (y0 - ay) / (by - ay), tb = (y1 - ay) / (by - ay);
+                float t0 = MAX(MIN(ta, tb), 0.0), t1 = MIN(MAX(ta, tb), 1.0);
+                xa = ax + (bx - ax) * t0;
+                xb = ax + (bx - ax) * t1;
+            }
+
+            if(!found) {
+                *x0 = MIN(xa, xb);
+                *x1 = MAX(xa, xb);
+                found = 1;
+            } else {
+                *x0 = MIN(*x0, MIN(xa, xb));
+                *x1 = MAX(*x1, MAX(xa, xb));
+            }
+        }
+    }
+
+    return found;
+}
+
+// Mip level a layer is sampled at, zoom is in pixels per base layer texel.
+static int gfx_layer_view_level(const struct gfx_layer *layer, float zoom) {
+    int level = (int)floorf(log2f(layer->scale / zoom));
+    return MAX(0, MIN(level, layer->num_levels - 1));
+}
+
+// Mark the pages covering the convex hull of points, in level 0 texels of
+// the base layer, wanted in every layer. Only pages of the level the view
+// samples at the zoom are marked, in the slice each layer shows.
+static void gfx_want_view(
+    struct gfx *gfx,
+    int wanted,
+    const float points[][2], int num_points,
+    float zoom) {
+    float min_y = points[0][1], max_y = points[0][1];
+    for(int i = 1; i < num_points; ++i) {
+        min_y = MIN(min_y, points[i][1]);
+        max_y = MAX(max_y, points[i][1]);
+    }
+
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        struct gfx_layer *layer = &gfx->layers[i];
+        int level = gfx_layer_view_level(layer, zoom);
+        if(level >= layer->num_sparse_levels)
+            continue; // in the mip tail
+
+        const struct page_table *table = &layer->page_tables[level];
+        float scale = layer->scale / (1 << level); // level texels per base texel
+        float page_width = layer->page_width / scale;
+        float page_height = layer->page_height / scale;
+
+        int page_y0 = MAX((int)floorf(min_y / page_height), 0);
+        int page_y1 = MIN((int)ceilf(max_y / page_height), table->pages_y);
+        int page_z = gfx_layer_page_z(layer, level, layer->slice);
+
+        for(int y = page_y0; y < page_y1; ++y) {
+            float x0, x1;
+            if(!hull_row_span(points, num_points, y * page_height, (y+1) * page_height, &x0, &x1))
+                continue;
+
+            int page_x0 = MAX((int)floorf(x0 / page_width), 0);
+            int page_x1 = MIN((int)ceilf(x1 / page_width), table->pages_x);
+            for(int x = page_x0; x < page_x1; ++x)
+                gfx_want_page(layer, wanted, level, x, y, page_z, 0);
+        }
+    }
+}
+
+static int gfx_feedback_init(struct gfx *gfx) {
+    int size = 0;
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        struct gfx_layer *layer = &gfx->layers[i];
+
+        for(int level = 0; level < layer->num_sparse_levels; ++level) {
+            layer->feedback_offsets[level] = size;
+            size += layer->page_tables[level].pages_x * layer->page_tables[level].num_rows;
+        }
+    }
+    gfx->feedback_size = size;
+    gfx->feedback_rd = gfx->feedback_wr = 0;
+    gfx->feedback_reads = 0;
+
+    gfx->page_requests = (struct page_request*)calloc(MAX(size, 1), sizeof(struct page_request));
+    gfx->max_page_requests = size;
+    if(!gfx->page_requests)
+        return -1;
+
+    GLbitfield storage_flags =
+        GL_CLIENT_STORAGE_BIT |
+        GL_MAP_READ_BIT |
+        GL_MAP_WRITE_BIT |
+        GL_MAP_PERSISTENT_BIT |
+        GL_MAP_COHERENT_BIT;
+
+    GLbitfield map_flags =
+        GL_MAP_READ_BIT |
+        GL_MAP_WRITE_BIT |
+        GL_MAP_PERSISTENT_BIT |
+        GL_MAP_COHERENT_BIT;
+
+    for(int i = 0; i < GFX_FEEDBACK_BUFFERS; ++i) {
+        struct gfx_feedback *feedback = &gfx->feedback[i];
+        uint64_t feedback_bytes = MAX(size, 1) * sizeof(uint32_t);
+
+        glGenBuffers(1, &feedback->ssbo);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, feedback->ssbo);
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, feedback_bytes, NULL, storage_flags);
+        feedback->hits = (uint32_t*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, feedback_bytes, map_flags);
+        feedback->syncpt = 0;
+
+        if(!feedback->hits)
+            return -1;
+
+        memset(feedback->hits, 0, feedback_bytes);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    return 0;
+}
+
+static void gfx_feedback_free(struct gfx *gfx) {
+    for(int i = 0; i < GFX_FEEDBACK_BUFFERS; ++i) {
+        struct gfx_feedback *feedback = &gfx->feedback[i];
+        if(feedback->syncpt)
+            glDeleteSync(feedback->syncpt);
+        if(feedback->ssbo)
+            glDeleteBuffers(1, &feedback->ssbo); // NOTE: unmaps implicitly
+        feedback->syncpt = 0;
+        feedback->ssbo = 0;
+        feedback->hits = NULL;
+    }
+
+    free(gfx->page_requests);
+    gfx->page_requests = NULL;
+}
+
+// Bind a free feedback buffer for the next frame, returns 0 if all of them
+// are still in flight.
+static int gfx_feedback_begin(struct gfx *gfx) {
+    int next = (gfx->feedback_wr + 1) % GFX_FEEDBACK_BUFFERS;
+    if(gfx->feedback_size == 0 || next == gfx->feedback_rd)
+        return 0;
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gfx->feedback[gfx->feedback_wr].ssbo);
+    return 1;
+}
+
+static void gfx_feedback_end(struct gfx *gfx) {
+    struct gfx_feedback *feedback = &gfx->feedback[gfx->feedback_wr];
+
+    glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+    GLbitfield fence_flags = 0; // must be zero
+    feedback->syncpt = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, fence_flags);
+
+    gfx->feedback_wr = (gfx->feedback_wr + 1) % GFX_FEEDBACK_BUFFERS;
+}
+
+// Replace the wanted pages with those sampled by the newest finished frame,
+// returns the number of pages sampled or 0 if no feedback has arrived.
+static int gfx_feedback_read(struct gfx *gfx) {
+    int num_wanted = 0;
+    while(gfx->feedback_rd != gfx->feedback_wr) {
+        struct gfx_feedback *feedback = &gfx->feedback[gfx->feedback_rd];
+        if(xfer_fence_status(feedback->syncpt) == 0)
+            break;
+
+        glDeleteSync(feedback->syncpt);
+        feedback->syncpt = 0;
+        gfx->feedback_rd = (gfx->feedback_rd + 1) % GFX_FEEDBACK_BUFFERS;
+
+        gfx_clear_wanted(gfx, PAGE_WANTED_SAMPLED);
+
+        num_wanted = 0;
+        for(int l = 0; l < gfx->num_layers; ++l) {
+            struct gfx_layer *layer = &gfx->layers[l];
+
+            for(int level = 0; level < layer->num_sparse_levels; ++level) {
+                const struct page_table *table = &layer->page_tables[level];
+                const uint32_t *hits = feedback->hits + layer->feedback_offsets[level];
+
+                for(int i = 0; i < table->pages_x * table->num_rows; ++i) {
+                    if(hits[i] == 0)
+                        continue;
+
+                    int row = i / table->pages_x;
+                    gfx->feedback_samples += hits[i];
+                    if(page_table_state(table, i % table->pages_x, row) != PAGE_RESIDENT)
+                        gfx->feedback_missing += hits[i];
+
+                    gfx_want_page(layer, PAGE_WANTED_SAMPLED,
+                        level, i % table->pages_x, row % table->pages_y, row / table->pages_y,
+                        hits[i]);
+                    num_wanted += 1;
+                }
+            }
+        }
+
+        memset(feedback->hits, 0, gfx->feedback_size * sizeof(uint32_t));
+        gfx->feedback_reads += 1;
+    }
+
+    return num_wanted;
+}
+
+static int page_request_compare(const void *a, const void *b) {
+    const struct page_request *ra = (const struct page_request*)a;
+    const struct page_request *rb = (const struct page_request*)b;
+
+    if(ra->layer != rb->layer)
+        return ra->layer - rb->layer;
+    if(ra->wanted != rb->wanted)
+        return rb->wanted - ra->wanted; // predicted pages last
+    if(ra->level != rb->level)
+        return rb->level - ra->level; // coarse levels first
+    if(ra->hits != rb->hits)
+        return ra->hits < rb->hits ? 1 : -1; // most sampled first
+
+    return ra->page_y != rb->page_y ? ra->page_y - rb->page_y : ra->page_x - rb->page_x;
+}
+
+// Request the wanted pages that are absent from all layers. Within a layer
+// sampled pages go before predicted ones, then coarse levels and the most
+// sampled pages first. Between layers, the one with the most urgent request
+// goes next, ties go to the layer that was served the fewest bytes lately.
+static int gfx_request_wanted(
     struct gfx *gfx,
-    int page_x0, int page_y0,
-    int page_x1, int page_y1,
     int wait,
     uint64_t frame_number) {
 
-    if( gfx->rect_page_x0 == page_x0 &&
-        gfx->rect_page_y0 == page_y0 &&
-        gfx->rect_page_x1 == page_x1 &&
-        gfx->rect_page_y1 == page_y1)
-        return 1; // nothing to commit / uncommit
-
-    if(gfx->rect_page_x1 <= gfx->rect_page_x0 ||
-        gfx->rect_page_y1 <= gfx->rect_page_y0 ||
-        page_x1 < gfx->rect_page_x0 ||
-        page_x0 > gfx->rect_page_x1 ||
-        page_y1 < gfx->rect_page_y0 ||
-        page_y0 > gfx->rect_page_y1) {
-        // no pages committed OR rectangles don't overlap
-
-        gfx_request_pages(gfx, 0,
-            gfx->rect_page_x0, gfx->rect_page_y0,
-            gfx->rect_page_x1, gfx->rect_page_y1,
-            wait, frame_number);
+    gfx_release_pages(gfx, wait, frame_number);
+
+    int num_requests = 0;
+    int requested_pages[GFX_MAX_LAYERS] = { 0 };
+    uint64_t committed_bytes = 0, requested_bytes = 0;
+    for(int l = 0; l < gfx->num_layers; ++l) {
+        struct gfx_layer *layer = &gfx->layers[l];
+        int page_bytes = gfx_layer_page_bytes(layer);
+
+        layer->served_bytes /= 2; // forget old service
+
+        for(int level = 0; level < layer->num_sparse_levels; ++level) {
+            struct page_table *table = &layer->page_tables[level];
+
+            // wanted pages are referenced, collect the ones still missing
+            for(int y = 0; y < table->num_rows; ++y) {
+                for(int x = 0; x < table->pages_x; ++x) {
+                    struct page_entry *entry = page_table_entry(table, x, y);
+                    if(!entry->wanted)
+                        continue;
+
+                    entry->referenced = 1;
+                    entry->used_frame = frame_number;
+
+                    int state = page_table_state(table, x, y);
+                    if(state == PAGE_ABSENT && num_requests < gfx->max_page_requests) {
+                        struct page_request *request = &gfx->page_requests[num_requests++];
+                        request->layer = l;
+                        request->wanted = entry->wanted;
+                        request->level = level;
+                        request->page_x = x;
+                        request->page_y = y;
+                        request->hits = entry->hits;
+                        requested_bytes += page_bytes;
+                        requested_pages[l] += 1;
+                    } else if(state == PAGE_EVICTING) {
+                        // still committed, take it back from the uncommit batch
+                        page_table_set_state(table, x, y, x+1, y+1, PAGE_RESIDENT);
+                        table->num_committed += 1;
+                        table->num_evicting -= 1;
+                    }
+                }
+            }
 
-        gfx_request_pages(gfx, 1,
-            page_x0, page_y0,
-            page_x1, page_y1,
-            wait, frame_number);
-    } else {
-        // width, height = positive -> commit, negative -> uncommit
-        int bottom_y = MIN(gfx->rect_page_y0, page_y0);
-        int bottom_height = gfx->rect_page_y0 - page_y0;
+            committed_bytes += (uint64_t)table->num_committed * page_bytes;
+        }
+    }
 
-        int top_y = MIN(gfx->rect_page_y1, page_y1);
-        int top_height = page_y1 - gfx->rect_page_y1;
+    // keep pages no longer sampled cached until the budget is exceeded,
+    // wanted pages are never evicted even if they alone exceed it
+    if(committed_bytes + requested_bytes > gfx->cache_budget) {
+        uint64_t low_watermark = GFX_CACHE_LOW_WATERMARK(gfx->cache_budget);
+        uint64_t target = low_watermark > requested_bytes ? low_watermark - requested_bytes : 0;
+        int64_t excess = committed_bytes - target;
+
+        // detail goes first in every layer, coarse levels are the fallback
+        for(int level = 0; level < GFX_MAX_LEVELS && excess > 0; ++level) {
+            for(int l = 0; l < gfx->num_layers && excess > 0; ++l) {
+                struct gfx_layer *layer = &gfx->layers[l];
+                if(level >= layer->num_sparse_levels)
+                    continue;
+
+                struct page_table *table = &layer->page_tables[level];
+                int page_bytes = gfx_layer_page_bytes(layer);
+                int level_committed = table->num_committed;
+                int excess_pages = (excess + page_bytes-1) / page_bytes;
+
+                page_table_evict(table,
+                    MAX(level_committed - excess_pages, 0),
+                    frame_number);
+
+                excess -= (int64_t)(level_committed - table->num_committed) * page_bytes;
+            }
+        }
+    }
 
-        int left_x = MIN(gfx->rect_page_x0, page_x0);
-        int left_width = gfx->rect_page_x0 - page_x0 ;
+    // an atlas only has slots for its share of the budget, slots come back
+    // once evicted pages are released
+    for(int l = 0; l < gfx->num_layers; ++l) {
+        struct gfx_layer *layer = &gfx->layers[l];
+        if(!layer->indirection)
+            continue;
 
-        int right_x = MIN(gfx->rect_page_x1, page_x1);
-        int right_width = page_x1 - gfx->rect_page_x1;
+        int excess_pages = requested_pages[l] - layer->num_free_slots;
+        for(int level = 0; level < layer->num_sparse_levels && excess_pages > 0; ++level) {
+            struct page_table *table = &layer->page_tables[level];
+            int level_committed = table->num_committed;
 
+            page_table_evict(table,
+                MAX(level_committed - excess_pages, 0),
+                frame_number);
+
+            excess_pages -= level_committed - table->num_committed;
+        }
+    }
 
-        if(bottom_height != 0) {
-            int y0 = bottom_y, y1 = bottom_y + (bottom_height < 0 ? -bottom_height : bottom_height);
-            int x0 = bottom_height < 0 ? gfx->rect_page_x0 : page_x0;
-            int x1 = bottom_height < 0 ? gfx->rect_page_x1 : page_x1;
+    // one sorted run of requests per layer
+    qsort(gfx->page_requests, num_requests, sizeof(struct page_request), page_request_compare);
+
+    int next[GFX_MAX_LAYERS], end[GFX_MAX_LAYERS];
+    for(int l = 0; l < gfx->num_layers; ++l)
+        next[l] = end[l] = 0;
+    for(int i = 0; i < num_requests; ++i) {
+        int l = gfx->page_requests[i].layer;
+        if(end[l] == 0)
+            next[l] = i;
+        end[l] = i + 1;
+    }
 
-            gfx_request_pages(gfx, bottom_height > 0, x0, y0, x1, y1, wait, frame_number);
+    // grow each request into a rectangle of wanted absent pages, pages
+    // queued, in flight or resident are never requested twice
+    for(;;) {
+        int l = -1;
+        for(int i = 0; i < gfx->num_layers; ++i) {
+            if(next[i] >= end[i])
+                continue;
+
+            if(l < 0 ||
+                gfx->page_requests[next[i]].wanted > gfx->page_requests[next[l]].wanted ||
+                (gfx->page_requests[next[i]].wanted == gfx->page_requests[next[l]].wanted &&
+                    gfx->layers[i].served_bytes < gfx->layers[l].served_bytes))
+                l = i;
         }
+        if(l < 0)
+            break;
+
+        const struct page_request *request = &gfx->page_requests[next[l]++];
+        struct gfx_layer *layer = &gfx->layers[l];
+        struct page_table *table = &layer->page_tables[request->level];
+        int page_bytes = gfx_layer_page_bytes(layer);
 
-        if(top_height != 0) {
-            int y0 = top_y, y1 = top_y + (top_height < 0 ? -top_height : top_height);
-            int x0 = top_height < 0 ? gfx->rect_page_x0 : page_x0;
-            int x1 = top_height < 0 ? gfx->rect_page_x1 : page_x1;
+        if(!page_table_match(table, request->page_x, request->page_y, PAGE_ABSENT, 1))
+            continue; // already part of an earlier rectangle
 
-            gfx_request_pages(gfx, top_height > 0, x0, y0, x1, y1, wait, frame_number);
+        int max_pages = gfx->xfer.buffer_size / page_bytes;
+        if(layer->indirection) {
+            if(layer->num_free_slots == 0)
+                continue; // atlas full until evicted pages are released
+
+            max_pages = MIN(max_pages, layer->num_free_slots);
         }
 
-        if(left_width != 0) {
-            int x0 = left_x, x1 = left_x + (left_width < 0 ? -left_width : left_width);
-            int y0 = bottom_y + (bottom_height < 0 ? -bottom_height : bottom_height);
-            int y1 = top_y;
+        // the request is the first match in these bounds, the rest of its slice
+        int slice_end = (request->page_y / table->pages_y + 1) * table->pages_y;
+        int x0, y0, x1, y1;
+        page_table_find_rect(table, PAGE_ABSENT, 1,
+            request->page_x, request->page_y, table->pages_x, slice_end,
+            max_pages,
+            &x0, &y0, &x1, &y1);
+
+        // out of staging buffers, the rest is requested again next frame
+        if(gfx_request_pages(gfx, layer, 1, request->level, x0, y0, x1, y1, wait, frame_number) != 1)
+            return 1;
+
+        layer->served_bytes += (uint64_t)(x1 - x0) * (y1 - y0) * page_bytes;
+    }
+
+    return 1;
+}
+
+#define ASTC_HEADER_SIZE (16)
+
+// Mip levels are stored as consecutive ASTC images in the same file, each
+// with its own header, a file with a single image only has level 0.
+// Array layers are the z slices of every level, 3D textures halve the depth
+// with each level.
+static int gfx_load_levels(struct gfx_layer *layer) {
+    const uint8_t *texptr = (const uint8_t*)texmmap_ptr(layer->texmmap);
+    uint64_t texsize = texmmap_size(layer->texmmap);
+
+    int width = 0, height = 0, depth = 0;
+    uint64_t offset = 0;
+    int num_levels = 0;
+    while(num_levels < GFX_MAX_LEVELS && offset + ASTC_HEADER_SIZE <= texsize) {
+        const struct astc_header *header = (const struct astc_header*)(texptr + offset);
+        if(header->magic[0] != 0x13 || header->magic[1] != 0xAB ||
+            header->magic[2] != 0xA1 || header->magic[3] != 0x5C)
+            break;
 
-            gfx_request_pages(gfx, left_width > 0, x0, y0, x1, y1, wait, frame_number);
+        int w = header->xsize[0] + (header->xsize[1] << 8) + (header->xsize[2] << 16);
+        int h = header->ysize[0] + (header->ysize[1] << 8) + (header->ysize[2] << 16);
+        int d = header->zsize[0] + (header->zsize[1] << 8) + (header->zsize[2] << 16);
+
+        if(num_levels == 0) {
+            width = w; height = h; depth = d;
+        } else if(w != width || h != height || d != depth) {
+            LOGW("**** Unexpected mip level %d size: %d x %d x %d", num_levels, w, h, d);
+            break;
         }
 
-        if(right_width != 0) {
-            int x0 = right_x, x1 = right_x + (right_width < 0 ? -right_width : right_width);
-            int y0 = bottom_y + (bottom_height < 0 ? -bottom_height : bottom_height);
-            int y1 = top_y;
+        int blocks_x = (w + layer->block_width-1) / layer->block_width;
+        int blocks_y = (h + layer->block_height-1) / layer->block_height;
+        int blocks_z = (d + layer->block_depth-1) / layer->block_depth;
+        uint64_t level_size = (uint64_t)blocks_x * blocks_y * blocks_z * (layer->block_size/8);
+        if(offset + ASTC_HEADER_SIZE + level_size > texsize)
+            break;
+
+        struct gfx_level *level = &layer->levels[num_levels];
+        level->data = texptr + offset + ASTC_HEADER_SIZE;
+        level->width = w;
+        level->height = h;
+        level->depth = d;
+        level->src_pitch = blocks_x * (layer->block_size/8);
+        level->src_slice_pitch = blocks_y * level->src_pitch;
+
+        num_levels += 1;
+        offset += ASTC_HEADER_SIZE + level_size;
+
+        int is_3d = layer->target == GL_TEXTURE_3D;
+        if(width == 1 && height == 1 && (!is_3d || depth == 1))
+            break;
+
+        width = MAX(width / 2, 1);
+        height = MAX(height / 2, 1);
+        if(is_3d)
+            depth = MAX(depth / 2, 1);
+    }
+
+    layer->num_levels = num_levels;
+
+    return num_levels > 0 ? 0 : -1;
+}
+
+static int astc_format(int block_width, int block_height, int block_depth) {
+    static const struct { int block_width, block_height, block_depth, format; } formats[] = {
+        { 4, 4, 1, GL_COMPRESSED_RGBA_ASTC_4x4_KHR },
+        { 5, 4, 1, GL_COMPRESSED_RGBA_ASTC_5x4_KHR },
+        { 5, 5, 1, GL_COMPRESSED_RGBA_ASTC_5x5_KHR },
+        { 6, 5, 1, GL_COMPRESSED_RGBA_ASTC_6x5_KHR },
+        { 6, 6, 1, GL_COMPRESSED_RGBA_ASTC_6x6_KHR },
+        { 8, 5, 1, GL_COMPRESSED_RGBA_ASTC_8x5_KHR },
+        { 8, 6, 1, GL_COMPRESSED_RGBA_ASTC_8x6_KHR },
+        { 8, 8, 1, GL_COMPRESSED_RGBA_ASTC_8x8_KHR },
+        { 10, 5, 1, GL_COMPRESSED_RGBA_ASTC_10x5_KHR },
+        { 10, 6, 1, GL_COMPRESSED_RGBA_ASTC_10x6_KHR },
+        { 10, 8, 1, GL_COMPRESSED_RGBA_ASTC_10x8_KHR },
+        { 10, 10, 1, GL_COMPRESSED_RGBA_ASTC_10x10_KHR },
+        { 12, 10, 1, GL_COMPRESSED_RGBA_ASTC_12x10_KHR },
+        { 12, 12, 1, GL_COMPRESSED_RGBA_ASTC_12x12_KHR },
+        { 3, 3, 3, GL_COMPRESSED_RGBA_ASTC_3x3x3_OES },
+        { 4, 3, 3, GL_COMPRESSED_RGBA_ASTC_4x3x3_OES },
+        { 4, 4, 3, GL_COMPRESSED_RGBA_ASTC_4x4x3_OES },
+        { 4, 4, 4, GL_COMPRESSED_RGBA_ASTC_4x4x4_OES },
+        { 5, 4, 4, GL_COMPRESSED_RGBA_ASTC_5x4x4_OES },
+        { 5, 5, 4, GL_COMPRESSED_RGBA_ASTC_5x5x4_OES },
+        { 5, 5, 5, GL_COMPRESSED_RGBA_ASTC_5x5x5_OES },
+        { 6, 5, 5, GL_COMPRESSED_RGBA_ASTC_6x5x5_OES },
+        { 6, 6, 5, GL_COMPRESSED_RGBA_ASTC_6x6x5_OES },
+        { 6, 6, 6, GL_COMPRESSED_RGBA_ASTC_6x6x6_OES },
+    };
+
+    for(unsigned i = 0; i < sizeof(formats)/sizeof(formats[0]); ++i)
+        if(formats[i].block_width == block_width &&
+            formats[i].block_height == block_height &&
+            formats[i].block_depth == block_depth)
+            return formats[i].format;
+
+    return 0;
+}
+
+#define GFX_MAX_PAGE_SIZES (8)
+#define GFX_PROBE_PAGES (16)
+
+// Commit and upload a few pages of level 0 to a scratch texture with the
+// given page size, returns bytes per second or 0 if the size is unusable.
+static double gfx_probe_page_size(
+    const struct gfx_layer *layer,
+    int pgsz_index,
+    int page_width, int page_height, int page_depth) {
+    const struct gfx_level *level = &layer->levels[0];
+    unsigned target = layer->target;
+
+    if(page_width <= 0 || page_height <= 0 || page_depth <= 0 ||
+        page_width % layer->block_width != 0 || page_height % layer->block_height != 0 ||
+        page_depth % layer->block_depth != 0 || page_depth > level->depth)
+        return 0.0;
+
+    int pages_x = level->width / page_width, pages_y = level->height / page_height;
+    int num_pages = MIN(GFX_PROBE_PAGES, pages_x * pages_y);
+    int page_pitch = (page_width / layer->block_width) * (layer->block_size/8);
+    int page_slice_pitch = page_pitch * (page_height / layer->block_height);
+    int page_bytes = page_slice_pitch * (page_depth / layer->block_depth);
+    if(num_pages == 0 || page_bytes > XFER_BUFFER_SIZE)
+        return 0.0;
+
+    uint8_t *pages = (uint8_t*)malloc((size_t)num_pages * page_bytes);
+    if(!pages)
+        return 0.0;
+
+    // blit up front, only commit and upload are timed
+    for(int i = 0; i < num_pages; ++i)
+        blockblit3d(level->data, level->src_pitch, level->src_slice_pitch,
+            (i % pages_x) * page_width, (i / pages_x) * page_height, 0,
+            pages + (size_t)i * page_bytes, page_pitch, page_slice_pitch,
+            layer->block_width, layer->block_height, layer->block_depth, layer->block_size/8,
+            page_width, page_height, page_depth);
+
+    unsigned texture;
+    glGenTextures(1, &texture);
+    glBindTexture(target, texture);
+    glTexParameteri(target, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+    glTexParameteri(target, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, pgsz_index);
+    if(target == GL_TEXTURE_2D)
+        glTexStorage2D(target, 1, layer->tex_format, level->width, level->height);
+    else
+        glTexStorage3D(target, 1, layer->tex_format, level->width, level->height, page_depth);
+    glFinish();
+
+    uint64_t start_time = time_ns();
+    for(int i = 0; i < num_pages; ++i) {
+        int x = (i % pages_x) * page_width, y = (i / pages_x) * page_height;
+
+        glTexPageCommitmentARB(
+            target,
+            0,
+            x, y, 0,
+            page_width, page_height, page_depth,
+            GL_TRUE);
+        if(target == GL_TEXTURE_2D)
+            glCompressedTexSubImage2D(
+                target,
+                0,
+                x, y,
+                page_width, page_height,
+                layer->tex_format,
+                page_bytes,
+                pages + (size_t)i * page_bytes);
+        else
+            glCompressedTexSubImage3D(
+                target,
+                0,
+                x, y, 0,
+                page_width, page_height, page_depth,
+                layer->tex_format,
+                page_bytes,
+                pages + (size_t)i * page_bytes);
+    }
+    glFinish();
+    uint64_t elapsed = time_ns() - start_time;
+
+    glDeleteTextures(1, &texture);
+    free(pages);
+
+    if(glGetError() != GL_NO_ERROR || elapsed == 0)
+        return 0.0;
+
+    return (double)num_pages * page_bytes * 1.0e9 / elapsed;
+}
+
+static int gfx_commit_mip_tail(struct gfx_layer *layer) {
+    int tail = layer->num_sparse_levels;
+    if(tail >= layer->num_levels)
+        return 0;
+
+    // atlas layers keep the tail in a texture of its own
+    unsigned texture = layer->tail ? layer->tail : layer->texture;
+    int base_level = layer->tail ? tail : 0;
+
+    // committing any part of the tail commits all of it, array textures
+    // have a separate tail for each layer
+    glBindTexture(layer->target, texture);
+    if(!layer->tail)
+        glTexPageCommitmentARB(
+            layer->target,
+            tail,
+            0, 0, 0,
+            layer->levels[tail].width, layer->levels[tail].height, layer->levels[tail].depth,
+            GL_TRUE);
+
+    for(int level = tail; level < layer->num_levels; ++level) {
+        const struct gfx_level *src_level = &layer->levels[level];
+        int blocks_z = (src_level->depth + layer->block_depth-1) / layer->block_depth;
+
+        if(layer->target == GL_TEXTURE_2D)
+            glCompressedTexSubImage2D(
+                layer->target,
+                level - base_level,
+                0, 0,
+                src_level->width, src_level->height,
+                layer->tex_format,
+                src_level->src_slice_pitch,
+                src_level->data);
+        else
+            glCompressedTexSubImage3D(
+                layer->target,
+                level - base_level,
+                0, 0, 0,
+                src_level->width, src_level->height, src_level->depth,
+                layer->tex_format,
+                blocks_z * src_level->src_slice_pitch,
+                src_level->data);
+    }
+
+    LOGI("**** MIP TAIL: levels %d - %d", tail, layer->num_levels-1);
+
+    return 0;
+}
+
+// Query the block size and virtual page sizes of a compressed format for a
+// texture target, returns the number of page sizes. Only the block size is
+// queried if page_sizes is NULL.
+static int gfx_format_page_sizes(
+    unsigned target,
+    int tex_format,
+    int *block_width, int *block_height, int *block_size,
+    int page_sizes[GFX_MAX_PAGE_SIZES][3]) {
+    glGetInternalformativ(
+        target, tex_format,
+        GL_TEXTURE_COMPRESSED_BLOCK_WIDTH,
+        sizeof(int), block_width);
+    glGetInternalformativ(
+        target, tex_format,
+        GL_TEXTURE_COMPRESSED_BLOCK_HEIGHT,
+        sizeof(int), block_height);
+    glGetInternalformativ(
+        target, tex_format,
+        GL_TEXTURE_COMPRESSED_BLOCK_SIZE,
+        sizeof(int), block_size);
+
+    if(!page_sizes)
+        return 0;
+
+    int num_page_sizes = 0;
+    glGetInternalformativ(
+        target, tex_format,
+        GL_NUM_VIRTUAL_PAGE_SIZES_ARB,
+        sizeof(int), &num_page_sizes);
+
+    int n = MAX(num_page_sizes, 1);
+    int page_size_x[n], page_size_y[n], page_size_z[n];
+    glGetInternalformativ(
+        target, tex_format,
+        GL_VIRTUAL_PAGE_SIZE_X_ARB,
+        num_page_sizes * sizeof(int), page_size_x);
+    glGetInternalformativ(
+        target, tex_format,
+        GL_VIRTUAL_PAGE_SIZE_Y_ARB,
+        num_page_sizes * sizeof(int), page_size_y);
+    glGetInternalformativ(
+        target, tex_format,
+        GL_VIRTUAL_PAGE_SIZE_Z_ARB,
+        num_page_sizes * sizeof(int), page_size_z);
+
+    num_page_sizes = MIN(num_page_sizes, GFX_MAX_PAGE_SIZES);
+    for(int i = 0; i < num_page_sizes; ++i) {
+        page_sizes[i][0] = page_size_x[i];
+        page_sizes[i][1] = page_size_y[i];
+        page_sizes[i][2] = page_size_z[i];
+    }
+
+    return num_page_sizes;
+}
+
+// Pages go into slots of an atlas of atlas_bytes, the indirection texture
+// has a texel for every page of every level.
+static int gfx_layer_init_atlas(struct gfx_layer *layer, uint64_t atlas_bytes) {
+    int page_width = layer->block_width * MAX(GFX_ATLAS_PAGE_SIZE / layer->block_width, 1);
+    int page_height = layer->block_height * MAX(GFX_ATLAS_PAGE_SIZE / layer->block_height, 1);
+    layer->page_width = page_width;
+    layer->page_height = page_height;
+    layer->page_depth = 1;
+
+    int tex_width = layer->levels[0].width, tex_height = layer->levels[0].height;
+    layer->tex_width = tex_width;
+    layer->tex_height = tex_height;
+    layer->tex_depth = 1;
+
+    // levels smaller than a page form the tail
+    int num_sparse_levels = 0;
+    while(num_sparse_levels < layer->num_levels &&
+        layer->levels[num_sparse_levels].width >= page_width &&
+        layer->levels[num_sparse_levels].height >= page_height)
+        num_sparse_levels += 1;
+    layer->num_sparse_levels = num_sparse_levels;
+
+    int max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+    int num_slots = atlas_bytes / gfx_layer_page_bytes(layer);
+    int atlas_pages_x = MIN(max_size / page_width, (int)ceil(sqrt(num_slots)));
+    int atlas_pages_y = MIN(max_size / page_height, num_slots / MAX(atlas_pages_x, 1));
+    if(atlas_pages_x < 1 || atlas_pages_y < 1)
+        return -1;
+    layer->atlas_pages_x = atlas_pages_x;
+    layer->atlas_pages_y = atlas_pages_y;
+    num_slots = atlas_pages_x * atlas_pages_y;
+
+    glGenTextures(1, &layer->texture);
+    glBindTexture(GL_TEXTURE_2D, layer->texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, layer->tex_format,
+        atlas_pages_x * page_width, atlas_pages_y * page_height);
+
+    int indirection_levels = MAX(num_sparse_levels, 1);
+    glGenTextures(1, &layer->indirection);
+    glBindTexture(GL_TEXTURE_2D, layer->indirection);
+    glTexStorage2D(GL_TEXTURE_2D, indirection_levels, GL_R32UI,
+        MAX(tex_width / page_width, 1), MAX(tex_height / page_height, 1));
+    // NOTE: integer textures are incomplete with linear filters, texelFetch returns 0
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    for(int level = 0; level < indirection_levels; ++level)
+        glClearTexImage(layer->indirection, level, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+    if(num_sparse_levels < layer->num_levels) {
+        const struct gfx_level *tail_level = &layer->levels[num_sparse_levels];
+        glGenTextures(1, &layer->tail);
+        glBindTexture(GL_TEXTURE_2D, layer->tail);
+        glTexStorage2D(GL_TEXTURE_2D, layer->num_levels - num_sparse_levels, layer->tex_format,
+            tail_level->width, tail_level->height);
+    }
+
+    // lowest slots are handed out first
+    layer->free_slots = (uint32_t*)malloc(num_slots * sizeof(uint32_t));
+    if(!layer->free_slots)
+        return -1;
+    for(int i = 0; i < num_slots; ++i)
+        layer->free_slots[i] = num_slots - i;
+    layer->num_free_slots = num_slots;
+
+    LOGI("**** ATLAS TEXTURE: %X  %d x %d  levels: %d  paged levels: %d  page: %d x %d  slots: %d x %d",
+        layer->tex_format, tex_width, tex_height, layer->num_levels, num_sparse_levels,
+        page_width, page_height, atlas_pages_x, atlas_pages_y);
+
+    for(int level = 0; level < num_sparse_levels; ++level) {
+        if(page_table_init(&layer->page_tables[level],
+                layer->levels[level].width / page_width,
+                layer->levels[level].height / page_height,
+                1,
+                page_width, page_height) != 0)
+            return -1;
+    }
+
+    return gfx_commit_mip_tail(layer);
+}
+
+// Sparse texture layer, or an atlas layer if atlas_bytes is not 0.
+static int gfx_layer_init(struct gfx_layer *layer, struct texmmap *texmmap, uint64_t atlas_bytes) {
+    layer->texmmap = texmmap;
+
+    if(!texmmap_ptr(layer->texmmap) || texmmap_size(layer->texmmap) < ASTC_HEADER_SIZE)
+        return -1;
+
+    const struct astc_header *header = (const struct astc_header*)texmmap_ptr(layer->texmmap);
+    int tex_format = astc_format(header->blockdim_x, header->blockdim_y, header->blockdim_z);
+    if(tex_format == 0) {
+        LOGW("**** Unsupported ASTC block size: %d x %d x %d",
+            header->blockdim_x, header->blockdim_y, header->blockdim_z);
+        return -1;
+    }
+
+    // 3D blocks make a volume, 2D blocks with depth an array of layers
+    int zsize = header->zsize[0] + (header->zsize[1] << 8) + (header->zsize[2] << 16);
+    if(header->blockdim_z > 1)
+        layer->target = GL_TEXTURE_3D;
+    else if(zsize > 1)
+        layer->target = GL_TEXTURE_2D_ARRAY;
+    else
+        layer->target = GL_TEXTURE_2D;
+
+    if(atlas_bytes && layer->target != GL_TEXTURE_2D) {
+        LOGW("**** Texture target %X needs sparse textures", layer->target);
+        return -1;
+    }
+
+    int page_sizes[GFX_MAX_PAGE_SIZES][3];
+    int block_width = 0, block_height = 0, block_size = 0;
+    int num_page_sizes = gfx_format_page_sizes(layer->target, tex_format,
+        &block_width, &block_height, &block_size,
+        atlas_bytes ? NULL : page_sizes);
+
+    if(block_size == 0 || (!atlas_bytes && num_page_sizes == 0)) {
+        LOGW("**** Texture format %X is not sparse", tex_format);
+        return -1;
+    }
+
+    layer->tex_format = tex_format;
+    layer->block_width = block_width;
+    layer->block_height = block_height;
+    layer->block_depth = header->blockdim_z; // XXX: no GL query for block depth
+    layer->block_size = block_size;
+
+    if(gfx_load_levels(layer) != 0)
+        return -1;
+
+    // XXX: levels aren't generated here, they come from the file
+    if(layer->num_levels == 1 && (layer->levels[0].width > 1 || layer->levels[0].height > 1))
+        LOGW("**** Texture file has level 0 only, no coarse levels or fallback when zoomed out");
 
-            gfx_request_pages(gfx, right_width > 0, x0, y0, x1, y1, wait, frame_number);
+    if(atlas_bytes)
+        return gfx_layer_init_atlas(layer, atlas_bytes);
+
+    // pick the page size with the best commit and upload throughput
+    int pgsz_index = -1;
+    double best_throughput = 0.0;
+    for(int i = 0; i < num_page_sizes; ++i) {
+        double throughput = gfx_probe_page_size(layer, i,
+            page_sizes[i][0], page_sizes[i][1], page_sizes[i][2]);
+
+        LOGI("**** PAGE SIZE %d: %3d x %3d x %3d  %lf GB/s",
+            i, page_sizes[i][0], page_sizes[i][1], page_sizes[i][2],
+            throughput / 1.0e9);
+
+        if(throughput > best_throughput) {
+            best_throughput = throughput;
+            pgsz_index = i;
         }
     }
 
-    // XXX: this may leak memory because there may be incomplete requests to
-    // COMMIT pages that we mark UNCOMMITTED here
-    gfx->rect_page_x0 = page_x0;
-    gfx->rect_page_y0 = page_y0;
-    gfx->rect_page_x1 = page_x1;
-    gfx->rect_page_y1 = page_y1;
+    if(pgsz_index < 0)
+        return -1;
 
-    return 1;
+    int page_width = page_sizes[pgsz_index][0];
+    int page_height = page_sizes[pgsz_index][1];
+    int page_depth = page_sizes[pgsz_index][2];
+    layer->page_width = page_width;
+    layer->page_height = page_height;
+    layer->page_depth = page_depth;
+
+    int tex_width = layer->levels[0].width, tex_height = layer->levels[0].height;
+    int tex_depth = layer->levels[0].depth;
+    layer->tex_width = tex_width;
+    layer->tex_height = tex_height;
+    layer->tex_depth = tex_depth;
+
+    unsigned target = layer->target;
+    glGenTextures(1, &layer->texture);
+    glBindTexture(target, layer->texture);
+    glTexParameteri(target, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+    glTexParameteri(target, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, pgsz_index);
+
+    int levels = layer->num_levels;
+    if(target == GL_TEXTURE_2D)
+        glTexStorage2D(target, levels, tex_format, tex_width, tex_height);
+    else
+        glTexStorage3D(target, levels, tex_format, tex_width, tex_height, tex_depth);
+
+    int num_sparse_levels = 0;
+    glGetTexParameteriv(target, GL_NUM_SPARSE_LEVELS_ARB, &num_sparse_levels);
+    layer->num_sparse_levels = MIN(num_sparse_levels, levels);
+
+    LOGI("**** TEXTURE: %X  %X  %d x %d x %d  levels: %d  sparse levels: %d",
+        target, tex_format, tex_width, tex_height, tex_depth, levels, layer->num_sparse_levels);
+
+    for(int level = 0; level < layer->num_sparse_levels; ++level) {
+        const struct gfx_level *src_level = &layer->levels[level];
+        if(page_table_init(&layer->page_tables[level],
+                src_level->width / page_width,
+                src_level->height / page_height,
+                MAX(src_level->depth / page_depth, 1),
+                page_width, page_height) != 0)
+            return -1;
+    }
+
+    return gfx_commit_mip_tail(layer);
+}
+
+static void gfx_layer_free(struct gfx_layer *layer) {
+    if(layer->texture)
+        glDeleteTextures(1, &layer->texture);
+    layer->texture = 0;
+
+    if(layer->indirection)
+        glDeleteTextures(1, &layer->indirection);
+    layer->indirection = 0;
+
+    if(layer->tail)
+        glDeleteTextures(1, &layer->tail);
+    layer->tail = 0;
+
+    free(layer->free_slots);
+    layer->free_slots = NULL;
+
+    for(int level = 0; level < GFX_MAX_LEVELS; ++level)
+        page_table_free(&layer->page_tables[level]);
 }
 
-int gfx_init(struct gfx *gfx, struct texmmap *texmmap) {
+int gfx_init(struct gfx *gfx, struct texmmap **texmmaps, int num_layers, int upload_thread) {
     memset(gfx, 0, sizeof(struct gfx));
-    gfx->texmmap = texmmap;
 
-    if(!texmmap_ptr(gfx->texmmap))
+    if(num_layers < 1 || num_layers > GFX_MAX_LAYERS)
         return -1;
 
+    // nothing painted yet, whatever the buffers hold is garbage
+    for(int i = 0; i < GFX_DAMAGE_HISTORY; ++i)
+        gfx->damage[i].full = 1;
+
     void *debug_data = NULL;
     glDebugMessageCallback(&gl_debug_callback, debug_data);
 
@@ -787,14 +2698,18 @@ int gfx_init(struct gfx *gfx, struct texmmap *texmmap) {
     LOGI("GL_RENDERER: %s", glGetString(GL_RENDERER));
     LOGI("GL_EXTENSIONS: %s", glGetString(GL_EXTENSIONS));
 
-    if(xfer_init(&gfx->xfer, XFER_BUFFER_SIZE) != 0)
+    // built while the layers are set up, finished at the end
+    gfx->program = shader_begin(vertex_src, 0, 0, 0, frag_src);
+    if(gfx->program == 0)
         return -1;
 
-    int tex_format = GL_COMPRESSED_RGBA_ASTC_8x8_KHR;
-    int pgsz_index = -1;
-    int page_width = 0, page_height = 0, page_depth = 0;
-    int block_width = 0, block_height = 0, block_size = 0;
-    (void)block_width; (void)block_height; (void)block_size;
+    if(xfer_init(&gfx->xfer, XFER_BUFFER_SIZE, upload_thread) != 0)
+        return -1;
+
+    gfx->sparse = !GFX_FORCE_ATLAS &&
+        gl_has_extension("GL_ARB_sparse_texture") &&
+        gl_has_extension("GL_EXT_sparse_texture2");
+    LOGI("**** RESIDENCY: %s", gfx->sparse ? "sparse textures" : "page atlas");
 
     int num_compressed_formats;
     glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &num_compressed_formats);
@@ -806,58 +2721,17 @@ int gfx_init(struct gfx *gfx, struct texmmap *texmmap) {
     for(int i = 0; i < num_compressed_formats; ++i) {
         int fmt = compressed_formats[i];
         int block_x, block_y, block_sz;
+        int page_sizes[GFX_MAX_PAGE_SIZES][3] = { { 0, 0, 0 } };
 
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_TEXTURE_COMPRESSED_BLOCK_WIDTH,
-            sizeof(int), &block_x);
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_TEXTURE_COMPRESSED_BLOCK_HEIGHT,
-            sizeof(int), &block_y);
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_TEXTURE_COMPRESSED_BLOCK_SIZE,
-            sizeof(int), &block_sz);
-
-        int num_page_sizes = 0;
-
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_NUM_VIRTUAL_PAGE_SIZES_ARB,
-            sizeof(int), &num_page_sizes);
-
-        int page_size_x[num_page_sizes],
-            page_size_y[num_page_sizes],
-            page_size_z[num_page_sizes];
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_VIRTUAL_PAGE_SIZE_X_ARB,
-            num_page_sizes * sizeof(int), page_size_x);
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_VIRTUAL_PAGE_SIZE_Y_ARB,
-            num_page_sizes * sizeof(int), page_size_y);
-        glGetInternalformativ(
-            GL_TEXTURE_2D, fmt,
-            GL_VIRTUAL_PAGE_SIZE_Z_ARB,
-            num_page_sizes * sizeof(int), page_size_z);
-
-        if(tex_format == fmt) {
-            pgsz_index = 0;
-            page_width = page_size_x[pgsz_index];
-            page_height = page_size_y[pgsz_index];
-            page_depth = page_size_z[pgsz_index];
-            block_width = block_x;
-            block_height = block_y;
-            block_size = block_sz;
-        }
+        int num_page_sizes = gfx_format_page_sizes(GL_TEXTURE_2D, fmt,
+            &block_x, &block_y, &block_sz,
+            gfx->sparse ? page_sizes : NULL);
 
         LOGI("\t%X  block %2d x %2d  (%3d bits):  %d page sizes  (%3d x %3d x %3d)",
             fmt,
             block_x, block_y, block_sz,
             num_page_sizes,
-            page_size_x[0], page_size_y[0], page_size_z[0]
+            page_sizes[0][0], page_sizes[0][1], page_sizes[0][2]
             );
     }
 
@@ -878,152 +2752,370 @@ int gfx_init(struct gfx *gfx, struct texmmap *texmmap) {
     //glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4*sizeof(float), 0);
     //glEnableVertexAttribArray(0);
 
-    gfx->program = shader_compile(vertex_src, 0, 0, 0, frag_src);
-    if(gfx->program == 0)
-        return -1;
-
-    void *texptr = texmmap_ptr(gfx->texmmap);
-    uint64_t texsize = texmmap_size(gfx->texmmap);
-    (void)texsize; // XXX: check that size is ok
-
-    const struct astc_header *header = (const struct astc_header*)texptr;
-    int w = header->xsize[0] + (header->xsize[1] << 8) + (header->xsize[2] << 16);
-    int h = header->ysize[0] + (header->ysize[1] << 8) + (header->ysize[2] << 16);
-    int d = header->zsize[0] + (header->zsize[1] << 8) + (header->zsize[2] << 16);
-    (void)d; // XXX: depth must be 1
+    gfx->cache_budget = GFX_CACHE_BUDGET;
 
-    glGenTextures(1, &gfx->texture);
-    glBindTexture(GL_TEXTURE_2D, gfx->texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
-    glTexParameteri(GL_TEXTURE_2D, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, pgsz_index);
+    // atlases are allocated up front, each layer gets an equal share
+    uint64_t atlas_bytes = gfx->sparse ? 0 : gfx->cache_budget / num_layers;
 
-    int tex_width = w, tex_height = h;
-    int levels = 1;
-    glTexStorage2D(GL_TEXTURE_2D, levels, tex_format, tex_width, tex_height);
-
-    gfx->tex_format = tex_format;
-    gfx->tex_width = tex_width;
-    gfx->tex_height = tex_height;
-    gfx->page_width = page_width;
-    gfx->page_height = page_height;
-    gfx->page_depth = page_depth;
-    gfx->block_width = block_width;
-    gfx->block_height = block_height;
-    gfx->block_size = block_size;
-
-    if(0) {
-        gfx_page_commit(gfx, 0, 0);
-        gfx_page_commit(gfx, 1, 0);
-        gfx_page_commit(gfx, 2, 0);
-        gfx_page_commit(gfx, 0, 1);
-        gfx_page_commit(gfx, 1, 1);
-        gfx_page_commit(gfx, 2, 1);
+    for(int i = 0; i < num_layers; ++i) {
+        gfx->num_layers = i + 1; // NOTE: freed by gfx_quit even if init fails
+        if(gfx_layer_init(&gfx->layers[i], texmmaps[i], atlas_bytes) != 0)
+            return -1;
 
-        gfx_page_uncommit(gfx, 1, 1);
-        gfx_page_commit(gfx, 1, 1);
+        // layers cover the same area, scaled to the base layer
+        gfx->layers[i].scale = (float)gfx->layers[i].tex_width / gfx->layers[0].tex_width;
     }
 
-    if(0) {
-        struct xfer_buffer *xfer_buffer = &gfx->xfer.buffers[0];
-
-        int src_pitch = (gfx->tex_width/gfx->block_width) * (gfx->block_size/8);
+    if(gfx_feedback_init(gfx) != 0)
+        return -1;
 
-        xfer_start(
-            xfer_buffer,
-            gfx->texture, gfx->tex_format,
-            texmmap_ptr(gfx->texmmap), src_pitch,
-            0 * gfx->page_width, 0 * page_height,
-            0, 0,
-            gfx->block_width, gfx->block_height, gfx->block_size,
-            4 * gfx->page_width, 4 * gfx->page_width,
-            0);
+    gfx->program = shader_finish(gfx->program);
+    if(gfx->program == 0)
+        return -1;
 
-        xfer_buffer_blit(xfer_buffer);
-        xfer_buffer_upload(xfer_buffer);
+    return 0;
+}
 
-        xfer_buffer_finish(xfer_buffer, 1, 0, 0, 0);
-    }
+// Add a rectangle to the damage, overlapping rectangles are merged and the
+// view is damaged in full when they don't fit.
+static void gfx_damage_add(struct gfx_damage *damage, const int rect[4]) {
+    int x0 = rect[0], y0 = rect[1], x1 = rect[0] + rect[2], y1 = rect[1] + rect[3];
 
-    int pages_x = 3, pages_y = 2;
-    for(int i = 0; 0 && i < pages_x*pages_y; ++i) {
-        LOGI("**** GET IDLE BUFFER");
+    for(int i = 0; i < damage->num_rects; ++i) {
+        int *other = damage->rects[i];
+        if(x0 > other[0] + other[2] || other[0] > x1 ||
+            y0 > other[1] + other[3] || other[1] > y1)
+            continue;
 
-        //if(i == 1) continue;
+        // grow the other one and add that instead, it may touch more
+        x0 = MIN(x0, other[0]); y0 = MIN(y0, other[1]);
+        x1 = MAX(x1, other[0] + other[2]); y1 = MAX(y1, other[1] + other[3]);
 
-        int buffer_id = -1;
-        xfer_queue_get(&gfx->xfer.queue, XFER_QUEUE_IDLE, 1, &buffer_id, 1);
-        struct xfer_buffer *xfer_buffer = &gfx->xfer.buffers[buffer_id];
+        damage->num_rects -= 1;
+        memcpy(other, damage->rects[damage->num_rects], sizeof(damage->rects[0]));
+        i = -1;
+    }
 
-        LOGI("**** STARTING BUFFER: %d", buffer_id);
+    if(damage->num_rects == GFX_MAX_DAMAGE_RECTS) {
+        damage->full = 1;
+        return;
+    }
 
-        int src_pitch = (gfx->tex_width/gfx->block_width) * (gfx->block_size/8);
-        xfer_start(
-            xfer_buffer,
-            gfx->texture, gfx->tex_format,
-            texmmap_ptr(gfx->texmmap), src_pitch,
-            (i%pages_x) * gfx->page_width, (i/pages_x) * page_height,
-            (i%pages_x) * gfx->page_width, (i/pages_x) * page_height,
-            gfx->block_width, gfx->block_height, gfx->block_size,
-            1 * gfx->page_width, 1 * gfx->page_width,
-            0);
+    int *added = damage->rects[damage->num_rects++];
+    added[0] = x0; added[1] = y0; added[2] = x1 - x0; added[3] = y1 - y0;
+}
 
-        xfer_queue_put(&gfx->xfer.queue, XFER_QUEUE_READ, buffer_id);
+// Damage the screen bounds of pages made resident since the last update.
+static void gfx_damage_resident(struct gfx *gfx, struct gfx_damage *damage) {
+    // pixels from texels, the inverse of the view matrix
+    const float *m = gfx->view_matrix;
+    float det = m[0] * m[3] - m[2] * m[1];
+
+    for(int i = 0; i < gfx->xfer.num_resident && !damage->full; ++i) {
+        const struct xfer_resident *resident = &gfx->xfer.resident[i];
+
+        for(int l = 0; l < gfx->num_layers; ++l) {
+            const struct gfx_layer *layer = &gfx->layers[l];
+            int level = resident->page_table - layer->page_tables;
+            if(level < 0 || level >= layer->num_sparse_levels)
+                continue;
+
+            // level texels to base layer texels to pixels
+            float scale = (1 << level) / layer->scale;
+            float x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+            for(int c = 0; c < 4; ++c) {
+                float tx = ((c & 1) ? resident->x1 : resident->x0) * scale - gfx->view_origin[0];
+                float ty = ((c & 2) ? resident->y1 : resident->y0) * scale - gfx->view_origin[1];
+                float px = (m[3] * tx - m[2] * ty) / det;
+                float py = (m[0] * ty - m[1] * tx) / det;
+
+                x0 = c ? MIN(x0, px) : px; x1 = c ? MAX(x1, px) : px;
+                y0 = c ? MIN(y0, py) : py; y1 = c ? MAX(y1, py) : py;
+            }
 
-        LOGI("**** STARTED BUFFER: %d", buffer_id);
+            int rect[4];
+            rect[0] = MAX((int)floorf(x0), 0);
+            rect[1] = MAX((int)floorf(y0), 0);
+            rect[2] = MIN((int)ceilf(x1), gfx->view_width) - rect[0];
+            rect[3] = MIN((int)ceilf(y1), gfx->view_height) - rect[1];
+            if(rect[2] > 0 && rect[3] > 0)
+                gfx_damage_add(damage, rect);
+        }
     }
-
-    return 0;
 }
 
-#include <math.h>
+#if GFX_DEMO_SCROLL
+static void demo_scroll(const struct gfx *gfx, double frame, float *scroll_x, float *scroll_y) {
+    const struct gfx_layer *layer = &gfx->layers[0];
+    float phase = (2.0*M_PI/5.0) * frame / 60.0;
+    float radius = pow(cos(phase/10.0), 2.0);
+    *scroll_x = (0.5 + radius * cosf(phase) * 0.5) * (layer->tex_width - 5 * layer->page_width);
+    *scroll_y = (0.5 + radius * sinf(phase) * 0.5) * (layer->tex_height - 5 * layer->page_height);
+}
+#endif
 
-int gfx_paint(
+// Finish transfers, request pages for the view and find what changed on
+// screen. Returns 1 if a frame needs to be painted.
+int gfx_update(
     struct gfx *gfx,
     const struct painter_state *state,
     int width, int height,
-    uint64_t frame_number) {
+    uint64_t frame_number,
+    uint64_t deadline) {
+    // uploads may fill the frame up to the present deadline
+    __atomic_store_n(&gfx->xfer.upload_deadline, deadline, __ATOMIC_RELAXED);
+
+    timing_phase_begin(&timing_, TIMING_FINISH);
     int num_finished = xfer_finish(&gfx->xfer, frame_number); // finish uploads
     if(num_finished > 0)
         LOGI("**** TRANSFERS FINISHED: %d", num_finished);
 
+    xfer_pool_update(&gfx->xfer, frame_number);
+    timing_phase_end(&timing_, TIMING_FINISH);
 
-#if 0
+#if !GFX_DEMO_SCROLL
     float scroll_x = state->scroll_x, scroll_y = state->scroll_y;
+    float scroll_vx = state->scroll_vx, scroll_vy = state->scroll_vy;
+    float scroll_ax = state->scroll_ax, scroll_ay = state->scroll_ay;
+    float zoom = exp2f(state->zoom), rotation = state->rotation;
+    int slice = floorf(state->slice);
 #else
     (void)state;
-    float phase = (2.0*M_PI/5.0) * frame_number / 60.0;
-    float radius = pow(cos(phase/10.0), 2.0);
-    float scroll_x = (0.5 + radius * cosf(phase) * 0.5) * (gfx->tex_width - 5 * gfx->page_width);
-    float scroll_y = (0.5 + radius * sinf(phase) * 0.5) * (gfx->tex_height - 5 * gfx->page_height);
+    float scroll_x, scroll_y, prev_x, prev_y, next_x, next_y;
+    demo_scroll(gfx, frame_number, &scroll_x, &scroll_y);
+    demo_scroll(gfx, frame_number - 1.0, &prev_x, &prev_y);
+    demo_scroll(gfx, frame_number + 1.0, &next_x, &next_y);
+
+    float scroll_vx = (next_x - prev_x) * 60.0 / 2.0;
+    float scroll_vy = (next_y - prev_y) * 60.0 / 2.0;
+    float scroll_ax = (next_x - 2.0 * scroll_x + prev_x) * 60.0 * 60.0;
+    float scroll_ay = (next_y - 2.0 * scroll_y + prev_y) * 60.0 * 60.0;
+
+    // XXX: zoom out and back in every 20 seconds, turning slowly
+    float zoom = exp2f(-2.0 + 2.0 * cosf((2.0*M_PI/20.0) * frame_number / 60.0));
+    float rotation = (2.0*M_PI/60.0) * frame_number / 60.0;
+
+    // XXX: step through the slices of array and 3D layers every second
+    int slice = frame_number / 60;
 #endif
 
-    int page_x0 = MAX(0, MIN((int)scroll_x, gfx->tex_width-1)) /
-        gfx->page_width;
-    int page_y0 = MAX(0, MIN((int)scroll_y, gfx->tex_width-1)) /
-        gfx->page_height;
-    int page_x1 = (MAX(0, MIN((int)scroll_x + width, gfx->tex_width-1)) + gfx->page_width-1) /
-        gfx->page_width;
-    int page_y1 = (MAX(0, MIN((int)scroll_y + height, gfx->tex_width-1)) + gfx->page_height-1) /
-        gfx->page_height;
+    // pixels map to texels around the screen center, scroll is the texel
+    // at the first pixel when not zoomed or rotated
+    float cos_r = cosf(rotation) / zoom, sin_r = sinf(rotation) / zoom;
+    float view_matrix[4] = { cos_r, sin_r, -sin_r, cos_r }; // column major
+    float half_width = 0.5 * width, half_height = 0.5 * height;
+    float view_origin_x = scroll_x + half_width - (cos_r * half_width - sin_r * half_height);
+    float view_origin_y = scroll_y + half_height - (sin_r * half_width + cos_r * half_height);
+
+    float view[4][2];
+    for(int i = 0; i < 4; ++i) {
+        float x = (i == 1 || i == 2) ? width : 0, y = (i >= 2) ? height : 0;
+        view[i][0] = view_origin_x + cos_r * x - sin_r * y;
+        view[i][1] = view_origin_y + sin_r * x + cos_r * y;
+    }
+
+    int view_changed = 0;
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        int depth = gfx->layers[i].tex_depth;
+        int layer_slice = (slice % depth + depth) % depth;
+        view_changed |= layer_slice != gfx->layers[i].slice;
+        gfx->layers[i].slice = layer_slice;
+    }
+
+    view_changed |= gfx->invalid;
+    gfx->invalid = 0;
+
+    view_changed |= width != gfx->view_width || height != gfx->view_height ||
+        view_origin_x != gfx->view_origin[0] || view_origin_y != gfx->view_origin[1] ||
+        memcmp(view_matrix, gfx->view_matrix, sizeof(view_matrix)) != 0;
+
+    gfx->view_width = width;
+    gfx->view_height = height;
+    gfx->view_origin[0] = view_origin_x;
+    gfx->view_origin[1] = view_origin_y;
+    memcpy(gfx->view_matrix, view_matrix, sizeof(view_matrix));
+    gfx->view_zoom = zoom;
+
+    // a moved view is painted in full, otherwise only where pages arrived
+    struct gfx_damage *damage = &gfx->damage[gfx->damage_wr];
+    damage->full = view_changed;
+    damage->num_rects = 0;
+    if(!view_changed)
+        gfx_damage_resident(gfx, damage);
+
+    // request what the shader sampled, the view is only a guess until the
+    // first feedback arrives
+    timing_phase_begin(&timing_, TIMING_REQUEST);
+    if(gfx_feedback_read(gfx) == 0 && gfx->feedback_reads == 0) {
+        gfx_clear_wanted(gfx, PAGE_WANTED_SAMPLED);
+        gfx_want_view(gfx, PAGE_WANTED_SAMPLED, (const float (*)[2])view, 4, zoom);
+    }
+
+    // prefetch the path to where the view is going to be when pages
+    // requested now become resident
+    gfx_clear_wanted(gfx, PAGE_WANTED_PREDICTED);
+    if(gfx->xfer.resident_latency != 0) {
+        float t = gfx->xfer.resident_latency / 1.0e9;
+        float dx = scroll_vx * t + 0.5 * scroll_ax * t * t;
+        float dy = scroll_vy * t + 0.5 * scroll_ay * t * t;
+        float max_dx = GFX_PREFETCH_MAX_SCREENS * width / zoom;
+        float max_dy = GFX_PREFETCH_MAX_SCREENS * height / zoom;
+        dx = MAX(-max_dx, MIN(dx, max_dx));
+        dy = MAX(-max_dy, MIN(dy, max_dy));
+
+        // the view swept from here to there
+        float swept[8][2];
+        for(int i = 0; i < 4; ++i) {
+            swept[i][0] = view[i][0];
+            swept[i][1] = view[i][1];
+            swept[4+i][0] = view[i][0] + dx;
+            swept[4+i][1] = view[i][1] + dy;
+        }
+
+        gfx_want_view(gfx, PAGE_WANTED_PREDICTED, (const float (*)[2])swept, 8, zoom);
+    }
+
+    gfx_request_wanted(gfx, 0, frame_number);
+    timing_phase_end(&timing_, TIMING_REQUEST);
+
+    return damage->full || damage->num_rects > 0;
+}
+
+// Screen rectangles that changed in the last buffer_age frames, the whole
+// view if the age is not known. Returns the number of rectangles.
+int gfx_damage(struct gfx *gfx, int buffer_age, int *rects, int max_rects) {
+    struct gfx_damage merged = { 0, 0, { { 0 } } };
+    merged.full = buffer_age <= 0 || buffer_age > GFX_DAMAGE_HISTORY;
+
+    for(int age = 0; age < buffer_age && !merged.full; ++age) {
+        const struct gfx_damage *damage =
+            &gfx->damage[(gfx->damage_wr - age + GFX_DAMAGE_HISTORY) % GFX_DAMAGE_HISTORY];
+
+        merged.full |= damage->full;
+        for(int i = 0; i < damage->num_rects; ++i)
+            gfx_damage_add(&merged, damage->rects[i]);
+    }
+
+    if(merged.full || merged.num_rects > max_rects) {
+        if(max_rects < 1)
+            return 0;
+
+        rects[0] = 0; rects[1] = 0;
+        rects[2] = gfx->view_width; rects[3] = gfx->view_height;
+        return 1;
+    }
+
+    memcpy(rects, merged.rects, merged.num_rects * 4 * sizeof(int));
+    return merged.num_rects;
+}
+
+// The surface was replaced, nothing painted before is on it.
+void gfx_invalidate(struct gfx *gfx) {
+    gfx->invalid = 1;
+}
+
+// Transfers in flight or feedback not read back yet, frames painted now
+// may still change.
+// NOTE: evicted pages are only released by later updates
+int gfx_busy(struct gfx *gfx) {
+    return GFX_DEMO_SCROLL ||
+        gfx_num_evicting(gfx) > 0 ||
+        xfer_queue_size(&gfx->xfer.queue, XFER_QUEUE_IDLE) != gfx->xfer.num_buffers ||
+        gfx->feedback_rd != gfx->feedback_wr;
+}
 
-    gfx_request_rect(gfx, page_x0, page_y0, page_x1, page_y1, 0, frame_number);
+// Paint the view of the last update inside the given screen rectangles.
+int gfx_paint(
+    struct gfx *gfx,
+    const int *rects, int num_rects,
+    uint64_t frame_number) {
+    int width = gfx->view_width, height = gfx->view_height;
+    float zoom = gfx->view_zoom;
 
+    // feedback must see the whole view, partial frames only fill in pages
+    // that became resident
+    int full = num_rects == 1 &&
+        rects[0] <= 0 && rects[1] <= 0 &&
+        rects[0] + rects[2] >= width && rects[1] + rects[3] >= height;
+
+    timing_phase_begin(&timing_, TIMING_DRAW);
     glViewport(0, 0, width, height);
+    glEnable(GL_SCISSOR_TEST);
 
     float clear_color[] = { 0.2, 0.4, 0.7, 1.0 };
-    glClearBufferfv(GL_COLOR, 0, clear_color);
+    for(int r = 0; r < num_rects; ++r) {
+        glScissor(rects[4*r+0], rects[4*r+1], rects[4*r+2], rects[4*r+3]);
+        glClearBufferfv(GL_COLOR, 0, clear_color);
+    }
 
     glUseProgram(gfx->program);
+    glBindVertexArray(gfx->vao);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gfx->texture);
+    // each sampler type has its own texture unit
     glUniform1i(0, 0);
+    glUniform1i(25, 1);
+    glUniform1i(26, 2);
+    glUniform1i(29, 3);
+    glUniform1i(30, 4);
+
+    glUniform2f(33, gfx->view_origin[0], gfx->view_origin[1]);
+    glUniformMatrix2fv(34, 1, GL_FALSE, gfx->view_matrix);
+
+    int feedback = full && gfx_feedback_begin(gfx);
+    int jitter = frame_number % (GFX_FEEDBACK_STRIDE * GFX_FEEDBACK_STRIDE);
+    glUniform1i(5, feedback ? GFX_FEEDBACK_STRIDE : 0);
+    glUniform2i(6, jitter % GFX_FEEDBACK_STRIDE, jitter / GFX_FEEDBACK_STRIDE);
+
+    // layers are drawn bottom up, missing pages of the base layer show up
+    // yellow, of the others transparent
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    for(int i = 0; i < gfx->num_layers; ++i) {
+        const struct gfx_layer *layer = &gfx->layers[i];
+
+        if(i == 1)
+            glEnable(GL_BLEND);
+
+        int tex_target = layer->target == GL_TEXTURE_2D_ARRAY ? 1 :
+            layer->target == GL_TEXTURE_3D ? 2 : 0;
+        glActiveTexture(GL_TEXTURE0 + tex_target);
+        glBindTexture(layer->target, layer->texture);
+
+        if(layer->indirection) { // the atlas is a plain 2D texture
+            tex_target = 3;
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, layer->indirection);
+            glActiveTexture(GL_TEXTURE4);
+            glBindTexture(GL_TEXTURE_2D, layer->tail);
+            glUniform1i(32, layer->atlas_pages_x);
+        }
+        glUniform1i(27, tex_target);
+        glUniform1i(31, layer->num_sparse_levels);
+        glUniform1i(36, gfx_layer_view_level(layer, zoom));
+        glUniform1i(28, layer->slice);
+        glUniform1i(3, layer->num_levels);
+        glUniform3i(4, layer->page_width, layer->page_height, layer->page_depth);
+        glUniform1iv(7, GFX_MAX_LEVELS, layer->feedback_offsets);
+        glUniform1f(23, layer->scale);
+        if(i == 0)
+            glUniform4f(24, 1.0, 1.0, 0.0, 1.0);
+        else
+            glUniform4f(24, 0.0, 0.0, 0.0, 0.0);
+
+        for(int r = 0; r < num_rects; ++r) {
+            glScissor(rects[4*r+0], rects[4*r+1], rects[4*r+2], rects[4*r+3]);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        }
+    }
+    glDisable(GL_BLEND);
+    glDisable(GL_SCISSOR_TEST);
 
-    glUniform1i(1, (int)scroll_x);
-    glUniform1i(2, (int)scroll_y);
+    gfx->damage_wr = (gfx->damage_wr + 1) % GFX_DAMAGE_HISTORY;
 
-    glBindVertexArray(gfx->vao);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    if(feedback)
+        gfx_feedback_end(gfx);
+    timing_phase_end(&timing_, TIMING_DRAW);
+
+    gfx_frame_fence(gfx, frame_number);
 
     GLenum glerror = GL_NO_ERROR;
     if((glerror = glGetError()) != GL_NO_ERROR) {
@@ -1031,20 +3123,97 @@ int gfx_paint(
         return -1;
     }
 
-    xfer_upload(&gfx->xfer, 0); // start new uploads
+    if(!gfx->xfer.upload_thread) {
+        timing_phase_begin(&timing_, TIMING_UPLOAD);
+        xfer_upload(&gfx->xfer, 0); // start new uploads
+        timing_phase_end(&timing_, TIMING_UPLOAD);
+    }
 
     return 0;
 }
 
+int gfx_upload(struct gfx *gfx) {
+    if(gfx->xfer.upload_thread)
+        return 0;
+
+    return xfer_upload(&gfx->xfer, 0);
+}
+
+// Drop staging buffers while the painter is idle, returns the time to sleep
+// until the next one may go, 0 if there's nothing to wait for.
+uint64_t gfx_trim(struct gfx *gfx) {
+    return xfer_pool_trim(&gfx->xfer, time_ns());
+}
+
+void gfx_set_notify(struct gfx *gfx, void (*notify)(void *data, int repaint), void *data) {
+    gfx->xfer.notify = notify;
+    gfx->xfer.notify_data = data;
+}
+
+int gfx_upload_main(struct gfx *gfx) {
+    trace_thread_name("upload");
+
+    void *debug_data = NULL;
+    glDebugMessageCallback(&gl_debug_callback, debug_data);
+
+    xfer_query_init(&gfx->xfer.query_pool);
+
+    // block on the upload queue until the transfer queues are stopped
+    while(xfer_upload(&gfx->xfer, 1) >= 0)
+        ;
+
+    xfer_query_poll(&gfx->xfer);
+    xfer_query_free(&gfx->xfer.query_pool);
+
+    return glGetError() == GL_NO_ERROR ? 0 : -1;
+}
+
+int gfx_upload_stop(struct gfx *gfx) {
+    return xfer_queue_stop(&gfx->xfer.queue);
+}
+
 #include <stdio.h>
 
+// Log streaming statistics since gfx_init.
+// NOTE: upload totals are updated by the upload context, close enough here
+void gfx_report(struct gfx *gfx) {
+    const struct xfer *xfer = &gfx->xfer;
+
+    LOGI("**** REPORT: uploaded %llu bytes in %.2f ms, %.3f GB/s",
+        xfer->upload_bytes, xfer->upload_nsec / 1.0e6,
+        xfer->upload_nsec ? (double)xfer->upload_bytes / xfer->upload_nsec : 0.0);
+    LOGI("**** REPORT: blitted %llu bytes in %.2f ms, %.3f GB/s",
+        xfer->blit_bytes, xfer->blit_nsec / 1.0e6,
+        xfer->blit_nsec ? (double)xfer->blit_bytes / xfer->blit_nsec : 0.0);
+
+    char histogram[XFER_BENCHMARK_HISTOGRAM * 22] = "";
+    int len = 0;
+    for(int i = 0; i < XFER_BENCHMARK_HISTOGRAM; ++i)
+        len += snprintf(histogram + len, sizeof(histogram) - len, " %llu", xfer->latency_histogram[i]);
+    LOGI("**** REPORT: latency in frames, the last bin is %d or more:%s",
+        XFER_BENCHMARK_HISTOGRAM-1, histogram);
+
+    // the feedback samples one pixel of each stride x stride block
+    LOGI("**** REPORT: non-resident pixels %.2f%% of %llu samples",
+        gfx->feedback_samples ? 100.0 * gfx->feedback_missing / gfx->feedback_samples : 0.0,
+        gfx->feedback_samples);
+}
+
 int gfx_quit(struct gfx *gfx) {
     xfer_free(&gfx->xfer);
 
     glDeleteVertexArrays(1, &gfx->vao);
     glDeleteBuffers(1, &gfx->vbo);
 
-    glDeleteProgram(gfx->program);
+    shader_delete(gfx->program);
+
+    gfx_feedback_free(gfx);
+
+    for(int i = 0; i < gfx->num_layers; ++i)
+        gfx_layer_free(&gfx->layers[i]);
+
+    for(; gfx->fence_rd != gfx->fence_wr; gfx->fence_rd = (gfx->fence_rd + 1) % GFX_MAX_FRAME_FENCES)
+        glDeleteSync(gfx->frame_fences[gfx->fence_rd]);
 
     // dump benchmark info
     LOGI("**** dumping bendchmark data");
@@ -1,5 +1,9 @@
+#include <string.h>
+
 #include <GLXW/glxw.h>
 
+#include "gldebug.h"
+
 #include <android/log.h>
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
 #define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
@@ -67,3 +71,14 @@ void APIENTRY gl_debug_callback(
             gl_debug_severity_string(severity),
             message);
 }
+
+int gl_has_extension(const char *name) {
+    int num_extensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+
+    for(int i = 0; i < num_extensions; ++i)
+        if(strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+            return 1;
+
+    return 0;
+}
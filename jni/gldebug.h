@@ -0,0 +1,20 @@
+#ifndef GLDEBUG_H
+#define GLDEBUG_H
+
+#include <GLXW/glxw.h>
+
+// GL helpers shared by the renderer and the shader module, for the context
+// current on the calling thread
+
+void APIENTRY gl_debug_callback(
+    GLenum source,
+    GLenum type,
+    GLuint id,
+    GLenum severity,
+    GLsizei length,
+    const GLchar* message,
+    const void* userParam);
+
+int gl_has_extension(const char *name);
+
+#endif
@@ -1,11 +1,18 @@
 #include <stdbool.h>
+#include <string.h>
+#include <math.h>
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLXW/glxw.h>
 
 #include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <android/input.h>
 #include <android/sensor.h>
@@ -20,100 +27,435 @@ static const clockid_t clock_id = CLOCK_MONOTONIC;
 static EGLDisplay display = 0;
 static EGLConfig config = 0;
 static int native_format = 0;
+static int has_surfaceless_context = 0;
+
+// repaint and present only the damaged parts of the surface
+static int has_buffer_age = 0;
+static PFNEGLSETDAMAGEREGIONKHRPROC set_damage_region = NULL;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_buffers_with_damage = NULL;
+#define MAX_DAMAGE_RECTS (8)
+
+// perform texture uploads on a separate thread with a shared context
+static const int use_upload_thread = 1;
+
+// record the streaming pipeline while painting, written out as Chrome JSON
+// trace when the painter stops
+static const int use_tracing = 0;
+#define TRACE_PATH "/data/data/foo.bar.NdkSkeleton/files/trace.json"
+
+// benchmark the same camera path on every build, record the state of each
+// frame and play it back paced on vsync or as fast as frames go
+#define REPLAY_OFF (0)
+#define REPLAY_RECORD (1)
+#define REPLAY_FIXED (2)
+#define REPLAY_UNTHROTTLED (3)
+static const int replay_mode = REPLAY_OFF;
+#define REPLAY_PATH "/data/data/foo.bar.NdkSkeleton/files/replay.bin"
 
 struct texmmap;
-extern struct texmmap texmmap_;
+struct texmmap *texmmap_get(int index);
 int texmmap_open(const char *dir, const char *filename, struct texmmap* texmmap);
 int texmmap_close(struct texmmap* texmmap);
 
+void shader_set_cache_dir(const char *dir);
+
+// streamed texture layers bottom up, only the first one is required
+//static const char *layer_files[] = { "scandinavia512.astc" };
+//static const char *layer_files[] = { "europe1024.astc" };
+static const char *layer_files[] = { "world16k.astc", "terrain16k.astc", "labels16k.astc" };
+#define MAX_LAYERS (sizeof(layer_files)/sizeof(layer_files[0]))
+
+static struct texmmap *layer_texmmaps[MAX_LAYERS];
+static int num_layers = 0;
+
 struct gfx;
 struct painter_state;
 extern struct gfx gfx_;
-int gfx_init(struct gfx *gfx, struct texmmap *texmmap);
-int gfx_paint(
+int gfx_init(struct gfx *gfx, struct texmmap **texmmaps, int num_layers, int upload_thread);
+int gfx_update(
     struct gfx *gfx,
     const struct painter_state *state,
     int width, int height,
+    uint64_t frame_number,
+    uint64_t deadline);
+int gfx_damage(struct gfx *gfx, int buffer_age, int *rects, int max_rects);
+int gfx_paint(
+    struct gfx *gfx,
+    const int *rects, int num_rects,
     uint64_t frame_number);
+int gfx_busy(struct gfx *gfx);
+void gfx_invalidate(struct gfx *gfx);
+void gfx_report(struct gfx *gfx);
 int gfx_quit(struct gfx *gfx);
+int gfx_upload(struct gfx *gfx);
+uint64_t gfx_trim(struct gfx *gfx);
+void gfx_set_notify(struct gfx *gfx, void (*notify)(void *data, int repaint), void *data);
+int gfx_upload_main(struct gfx *gfx);
+int gfx_upload_stop(struct gfx *gfx);
+
+// NOTE: same phases as in timing.c
+enum timing_phase { TIMING_FINISH, TIMING_REQUEST, TIMING_DRAW, TIMING_UPLOAD, TIMING_SWAP };
+struct timing;
+extern struct timing timing_;
+int timing_init(struct timing *timing);
+void timing_free(struct timing *timing);
+void timing_frame_begin(struct timing *timing, uint64_t frame_number);
+void timing_frame_end(struct timing *timing, uint64_t period);
+void timing_phase_begin(struct timing *timing, int phase);
+void timing_phase_end(struct timing *timing, int phase);
+int timing_poll(struct timing *timing);
+void timing_report(struct timing *timing);
+
+void trace_start(void);
+int trace_stop(const char *path);
+void trace_thread_name(const char *name);
+
+struct replay;
+extern struct replay replay_;
+int replay_record(struct replay *replay, const char *path);
+int replay_open(struct replay *replay, const char *path);
+int replay_write(struct replay *replay, const struct painter_state *state, int width, int height);
+int replay_read(struct replay *replay, struct painter_state *state, int width, int height);
+void replay_close(struct replay *replay);
+
+struct pacer;
+extern struct pacer pacer_;
+int pacer_start(struct pacer *pacer);
+void pacer_stop(struct pacer *pacer);
+void pacer_set_active(struct pacer *pacer, int active);
+uint64_t pacer_period(struct pacer *pacer);
+uint64_t pacer_next_vsync(struct pacer *pacer, uint64_t time);
 
 struct painter_state {
     float scroll_x, scroll_y;
-    float scroll_vx, scroll_vy;
+    float scroll_vx, scroll_vy; // texels per second
+    float scroll_ax, scroll_ay; // texels per second^2
+    float zoom; // log2 of pixels per texel, about the screen center
+    float rotation; // radians, clockwise on screen
+    float slice; // array layer or 3D slice shown, wraps around the depth
 };
 
 static struct painter {
     ANativeActivity *native_activity;
     ANativeWindow *native_window;
-    EGLSurface surface;
+    EGLSurface surface; // written by the activity, EGL_NO_SURFACE while hidden
     EGLContext context;
+    EGLContext upload_context;
 
-    pthread_mutex_t lock;
-    pthread_cond_t state_changed;
+    // the painter and its textures outlive window surfaces when contexts can
+    // be current without one, a new surface is handed over and the painter
+    // confirms it let go of the old one
+    int running;
+    int surface_changed; // NOTE: atomic
+    int exited; // NOTE: atomic, the painter no longer answers
+    sem_t surface_bound;
 
     pthread_t painter_thread;
+    pthread_t upload_thread;
+
+    // NOTE: atomic, set by any thread and consumed by the painter, which is
+    // only woken through the eventfd while it is sleeping
+    int stopped, dirty, painting, upload_pending;
+    int sleeping;
+    int wake_fd;
+
+    // camera state of the input thread, published to the painter through a
+    // sequence lock so neither side ever blocks the other
+    struct painter_state input_state; // only used by the input thread
+    uint32_t state_seq; // NOTE: atomic, odd while being written
+    uint32_t state_words[sizeof(struct painter_state) / sizeof(uint32_t)]; // NOTE: atomic
+    int touching; // NOTE: atomic
+
+    // released gestures keep scrolling and slow down on the painter thread
+    uint32_t fling_seq; // state the fling started from
+    float fling_x, fling_y; // scroll added by flings
+    float fling_vx, fling_vy;
+    uint64_t fling_time; // fling was last advanced, 0 if not started
+} painter_;
 
-    int stopped, dirty, painting;
+static void painter_wake(struct painter *painter) {
+    // NOTE: sequentially consistent with the painter going to sleep, either
+    // the painter sees the flag or this sees the painter sleeping
+    if(!__atomic_load_n(&painter->sleeping, __ATOMIC_SEQ_CST))
+        return;
 
-    struct painter_state state;
-} painter_;
+    uint64_t one = 1;
+    if(write(painter->wake_fd, &one, sizeof(one)) != sizeof(one))
+        LOGW("**** PAINTER WAKE FAILED: %d", errno);
+}
+
+static void painter_signal(struct painter *painter, int *flag) {
+    __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+    painter_wake(painter);
+}
+
+// Latest state published by the input thread, returns its sequence number.
+static uint32_t painter_get_state(struct painter *painter, struct painter_state *state, int *touching) {
+    uint32_t words[sizeof(struct painter_state) / sizeof(uint32_t)];
+    uint32_t seq0, seq1;
+    do {
+        seq0 = __atomic_load_n(&painter->state_seq, __ATOMIC_ACQUIRE);
+        for(size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+            words[i] = __atomic_load_n(&painter->state_words[i], __ATOMIC_RELAXED);
+        *touching = __atomic_load_n(&painter->touching, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&painter->state_seq, __ATOMIC_RELAXED);
+    } while(seq0 != seq1 || (seq0 & 1));
+
+    memcpy(state, words, sizeof(words));
+    return seq0;
+}
+
+static void *uploader_main(void *ptr) {
+    struct painter *painter = (struct painter*)ptr;
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, painter->upload_context);
+
+    int error = 0;
+    if(gfx_upload_main(&gfx_) != 0)
+        error = -1;
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    return error == 0 ? ptr : NULL;
+}
+
+static void painter_notify(void *data, int repaint) {
+    struct painter *painter = (struct painter*)data;
+    painter_signal(painter, repaint ? &painter->dirty : &painter->upload_pending);
+}
+
+// flings decay exponentially and stop when slower than this on screen
+#define FLING_TIME_CONSTANT (0.325) // seconds
+#define FLING_MIN_SPEED (20.0) // pixels per second
+
+// Advance a released gesture to the given time and add it to the input
+// state, returns 1 while it moves.
+// NOTE: only called by the painter
+static int painter_fling(
+    struct painter *painter,
+    struct painter_state *state, int touching, uint32_t seq,
+    uint64_t time) {
+    // every input change restarts from the velocity it left
+    if(seq != painter->fling_seq) {
+        painter->fling_seq = seq;
+        painter->fling_vx = touching ? 0.0 : state->scroll_vx;
+        painter->fling_vy = touching ? 0.0 : state->scroll_vy;
+        painter->fling_time = 0;
+    }
+
+    if(touching) {
+        state->scroll_x += painter->fling_x;
+        state->scroll_y += painter->fling_y;
+        return 0;
+    }
+
+    float speed = sqrtf(painter->fling_vx * painter->fling_vx + painter->fling_vy * painter->fling_vy);
+    if(speed * exp2f(state->zoom) < FLING_MIN_SPEED) {
+        painter->fling_vx = painter->fling_vy = 0.0;
+        painter->fling_time = 0;
+    } else if(painter->fling_time != 0) {
+        // exact integral of v0 * exp(-t / tau) over the step
+        float dt = (time - painter->fling_time) * 1.0e-9;
+        float decay = expf(-dt / FLING_TIME_CONSTANT);
+        painter->fling_x += painter->fling_vx * FLING_TIME_CONSTANT * (1.0 - decay);
+        painter->fling_y += painter->fling_vy * FLING_TIME_CONSTANT * (1.0 - decay);
+        painter->fling_vx *= decay;
+        painter->fling_vy *= decay;
+        painter->fling_time = time;
+    } else {
+        painter->fling_time = time;
+    }
+
+    // the prefetcher extrapolates with the deceleration
+    state->scroll_x += painter->fling_x;
+    state->scroll_y += painter->fling_y;
+    state->scroll_vx = painter->fling_vx;
+    state->scroll_vy = painter->fling_vy;
+    state->scroll_ax = -painter->fling_vx / FLING_TIME_CONSTANT;
+    state->scroll_ay = -painter->fling_vy / FLING_TIME_CONSTANT;
+
+    return painter->fling_time != 0;
+}
 
 static void *painter_main(void *ptr) {
     struct painter *painter = (struct painter*)ptr;
 
-    eglMakeCurrent(display, painter->surface, painter->surface, painter->context);
+    EGLSurface surface = painter->surface;
+    eglMakeCurrent(display, surface, surface, painter->context);
     eglSwapInterval(display, 1);
 
-    int error = 0;
-    if(gfx_init(&gfx_, &texmmap_) != 0)
+    int upload_thread = painter->upload_context != EGL_NO_CONTEXT;
+
+    if(use_tracing)
+        trace_start();
+    trace_thread_name("painter");
+
+    int error = painter->wake_fd < 0 ? -1 : 0;
+    if(error == 0 && gfx_init(&gfx_, layer_texmmaps, num_layers, upload_thread) != 0)
         error = -1;
+    else
+        gfx_set_notify(&gfx_, painter_notify, painter);
+
+    timing_init(&timing_);
+
+    int uploading = 0;
+    if(error == 0 && upload_thread) {
+        if(pthread_create(&painter->upload_thread, NULL, uploader_main, painter) == 0)
+            uploading = 1;
+        else
+            error = -1;
+    }
+
+    // frames start at vsync and are presented by the next one
+    pacer_start(&pacer_);
+    int pacing = 0;
 
     uint64_t frame_number = 0;
     uint64_t nanoseconds = 1000000000;
-    uint64_t min_interval = 1 * nanoseconds / 150;
     uint64_t last_frame_time = 0;
 
+    // frames are paced by vsync only while something is changing, an idle
+    // painter sleeps until the state changes
+    int animating = 1;
+
+    int replaying = REPLAY_OFF;
+    if(error == 0 && replay_mode == REPLAY_RECORD && replay_record(&replay_, REPLAY_PATH) == 0)
+        replaying = REPLAY_RECORD;
+    else if(error == 0 && replay_mode >= REPLAY_FIXED && replay_open(&replay_, REPLAY_PATH) == 0)
+        replaying = replay_mode;
+
+    if(replaying == REPLAY_UNTHROTTLED)
+        eglSwapInterval(display, 0);
+    uint64_t replay_start_time = 0, replay_start_frame = 0;
+
     uint64_t last_fps_report_time = 0;
     uint64_t last_fps_frame = 0;
     while(error == 0) {
-        // lock the mutex and check if repaint is needed
-        int stopped = 0;
-        pthread_mutex_lock(&painter->lock);
-
-        int waiting = 1;
-        while(waiting) {
-            if(painter->stopped || painter->dirty) {
+        // check if repaint is needed, sleep until the next frame or until
+        // woken up otherwise
+        int waiting = 1, upload_only = 0;
+        __atomic_store_n(&painter->sleeping, 1, __ATOMIC_SEQ_CST);
+        while(waiting && error == 0) {
+            int painting = __atomic_load_n(&painter->painting, __ATOMIC_SEQ_CST);
+
+            struct timespec now;
+            clock_gettime(clock_id, &now);
+            uint64_t now_ns = (uint64_t)now.tv_sec * nanoseconds + (uint64_t)now.tv_nsec;
+            uint64_t next_frame = pacer_next_vsync(&pacer_, last_frame_time);
+
+            struct timespec timeout = { 0, 0 };
+            struct timespec *wait_timeout = NULL;
+
+            if(__atomic_load_n(&painter->stopped, __ATOMIC_SEQ_CST) ||
+                __atomic_load_n(&painter->surface_changed, __ATOMIC_SEQ_CST) ||
+                __atomic_load_n(&painter->dirty, __ATOMIC_SEQ_CST) ||
+                (painting && replaying == REPLAY_UNTHROTTLED)) {
+                waiting = 0;
+            } else if(__atomic_load_n(&painter->upload_pending, __ATOMIC_SEQ_CST)) {
                 waiting = 0;
-            } else if(painter->painting && last_frame_time != 0) {
-                uint64_t next_frame = last_frame_time + min_interval;
-                struct timespec timeout = {
-                    next_frame / nanoseconds, // seconds
-                    next_frame % nanoseconds  // nanoseconds
-                };
-
-                int err = pthread_cond_timedwait(
-                    &painter->state_changed, &painter->lock,
-                    &timeout);
-
-                if(err == ETIMEDOUT)
+                upload_only = 1;
+            } else if(painting && animating && last_frame_time != 0) {
+                if(now_ns >= next_frame) {
                     waiting = 0;
-                else if(err != 0)
+                } else {
+                    timeout.tv_sec = (next_frame - now_ns) / nanoseconds;
+                    timeout.tv_nsec = (next_frame - now_ns) % nanoseconds;
+                    wait_timeout = &timeout;
+                }
+            }
+
+            if(!waiting)
+                break;
+
+            // nothing painted or uploaded, the idle staging pool shrinks on a timer
+            uint64_t trim = wait_timeout ? 0 : gfx_trim(&gfx_);
+            if(trim > 0) {
+                timeout.tv_sec = trim / nanoseconds;
+                timeout.tv_nsec = trim % nanoseconds;
+                wait_timeout = &timeout;
+            }
+
+            struct pollfd wake = { painter->wake_fd, POLLIN, 0 };
+            int ret = ppoll(&wake, 1, wait_timeout, NULL);
+            if(ret > 0) {
+                uint64_t count;
+                if(read(painter->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
                     error = -1;
-            } else if(!painter->painting) {
-                pthread_cond_wait(&painter->state_changed, &painter->lock);
+            } else if(ret < 0 && errno != EINTR) {
+                error = -1;
             }
         }
+        __atomic_store_n(&painter->sleeping, 0, __ATOMIC_SEQ_CST);
 
-        struct painter_state state = painter->state;
-        stopped = painter->stopped;
-        painter->dirty = 0;
+        int stopped = __atomic_load_n(&painter->stopped, __ATOMIC_SEQ_CST);
+        int painting = __atomic_load_n(&painter->painting, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&painter->dirty, 0, __ATOMIC_SEQ_CST))
+            upload_only = 0;
+        __atomic_store_n(&painter->upload_pending, 0, __ATOMIC_SEQ_CST);
 
-        pthread_mutex_unlock(&painter->lock);
+        struct painter_state state;
+        int touching;
+        uint32_t state_seq = painter_get_state(painter, &state, &touching);
+
+        struct timespec wakeup;
+        clock_gettime(clock_id, &wakeup);
+        int flinging = painter_fling(painter, &state, touching, state_seq,
+            (uint64_t)wakeup.tv_sec * nanoseconds + (uint64_t)wakeup.tv_nsec);
 
         // exit loop if stopped or error has occured
         if(stopped || error != 0)
             break;
 
+        // rebind to the new window surface or none, everything else stays
+        if(__atomic_exchange_n(&painter->surface_changed, 0, __ATOMIC_SEQ_CST)) {
+            surface = painter->surface;
+            if(eglMakeCurrent(display, surface, surface, painter->context) != EGL_TRUE)
+                error = -1;
+            if(surface != EGL_NO_SURFACE)
+                eglSwapInterval(display, replaying == REPLAY_UNTHROTTLED ? 0 : 1);
+
+            gfx_invalidate(&gfx_);
+            sem_post(&painter->surface_bound);
+
+            LOGI("**** PAINTER SURFACE: %p", surface);
+            if(error != 0)
+                break;
+        }
+
+        // keep streaming without a surface, painting resumes with a new one
+        if(surface == EGL_NO_SURFACE) {
+            if(gfx_upload(&gfx_) < 0)
+                error = -1;
+            animating = 0;
+
+            // no vsync to wait for in the background
+            if(pacing) {
+                pacing = 0;
+                pacer_set_active(&pacer_, 0);
+            }
+            continue;
+        }
+
+        if((painting && animating) != pacing) {
+            pacing = painting && animating;
+            pacer_set_active(&pacer_, pacing);
+        }
+
+        // blits finished between frames, start uploads without repainting
+        if(upload_only) {
+            if(gfx_upload(&gfx_) < 0)
+                error = -1;
+
+            // don't let a steady stream of uploads delay the next frame
+            struct timespec now;
+            clock_gettime(clock_id, &now);
+            uint64_t now_ns = (uint64_t)now.tv_sec * nanoseconds + (uint64_t)now.tv_nsec;
+            if(!painting || now_ns < pacer_next_vsync(&pacer_, last_frame_time))
+                continue;
+        }
+
         // frame timer clock
         struct timespec frametime;
         clock_gettime(clock_id, &frametime);
@@ -124,17 +466,79 @@ static void *painter_main(void *ptr) {
         //int awidth = ANativeWindow_getWidth(painter->native_window);
         //int aheight = ANativeWindow_getHeight(painter->native_window);
         int width, height;
-        eglQuerySurface(display, painter->surface, EGL_WIDTH, &width);
-        eglQuerySurface(display, painter->surface, EGL_HEIGHT, &height);
+        eglQuerySurface(display, surface, EGL_WIDTH, &width);
+        eglQuerySurface(display, surface, EGL_HEIGHT, &height);
+
+        // played back frames replace touch input until the path ends
+        if(replaying >= REPLAY_FIXED) {
+            if(replay_start_time == 0) {
+                replay_start_time = last_frame_time;
+                replay_start_frame = frame_number;
+            }
+
+            if(replay_read(&replay_, &state, width, height) != 1) {
+                uint64_t frames = frame_number - replay_start_frame;
+                double seconds = (last_frame_time - replay_start_time) / 1.0e9;
+                LOGI("**** REPLAY REPORT: %llu frames in %.2f s, %.1f fps, %s",
+                    (unsigned long long)frames, seconds, seconds > 0.0 ? frames / seconds : 0.0,
+                    replaying == REPLAY_FIXED ? "vsync" : "unthrottled");
+                timing_report(&timing_);
+                gfx_report(&gfx_);
+
+                replay_close(&replay_);
+                if(replaying == REPLAY_UNTHROTTLED)
+                    eglSwapInterval(display, 1);
+                replaying = REPLAY_OFF;
+            }
+        }
+
+        // uploads may use what is left until the vsync after this frame started
+        uint64_t deadline = replaying == REPLAY_UNTHROTTLED ? 0 :
+            pacer_next_vsync(&pacer_, last_frame_time);
+        timing_poll(&timing_);
+        timing_frame_begin(&timing_, frame_number);
+        int update = gfx_update(&gfx_, &state, width, height, frame_number, deadline);
+        if(update >= 0 && replaying == REPLAY_RECORD)
+            replay_write(&replay_, &state, width, height);
 
-        // paint the screen
-        if(gfx_paint(&gfx_, &state, width, height, frame_number) != 0)
+        if(update < 0) {
             error = -1;
-        else
-            eglSwapBuffers(display, painter->surface);
+        } else if(update > 0) {
+            // repaint what changed since this buffer was last presented
+            EGLint buffer_age = 0;
+            if(has_buffer_age)
+                eglQuerySurface(display, surface, EGL_BUFFER_AGE_EXT, &buffer_age);
+
+            int rects[4 * MAX_DAMAGE_RECTS];
+            int num_rects = gfx_damage(&gfx_, buffer_age, rects, MAX_DAMAGE_RECTS);
+            if(set_damage_region)
+                set_damage_region(display, surface, rects, num_rects);
+
+            // the compositor only needs what changed since the last frame
+            // NOTE: taken before gfx_paint moves on to the next frame's damage
+            int swap_rects[4 * MAX_DAMAGE_RECTS];
+            int num_swap_rects = gfx_damage(&gfx_, 1, swap_rects, MAX_DAMAGE_RECTS);
+
+            if(gfx_paint(&gfx_, rects, num_rects, frame_number) != 0) {
+                error = -1;
+            } else if(swap_buffers_with_damage) {
+                timing_phase_begin(&timing_, TIMING_SWAP);
+                swap_buffers_with_damage(display, surface, swap_rects, num_swap_rects);
+                timing_phase_end(&timing_, TIMING_SWAP);
+            } else {
+                timing_phase_begin(&timing_, TIMING_SWAP);
+                eglSwapBuffers(display, surface);
+                timing_phase_end(&timing_, TIMING_SWAP);
+            }
+            timing_frame_end(&timing_, pacer_period(&pacer_));
+
+            // increase frame number
+            frame_number += 1;
+        } else if(gfx_upload(&gfx_) < 0) {
+            error = -1;
+        }
 
-        // increase frame number
-        frame_number += 1;
+        animating = replaying >= REPLAY_FIXED || flinging || update > 0 || gfx_busy(&gfx_);
 
         // Report FPS once every 5 seconds
         if(last_fps_report_time + nanoseconds * 5 < last_frame_time) {
@@ -146,14 +550,37 @@ static void *painter_main(void *ptr) {
             last_fps_frame = frame_number;
 
             LOGI("**** PAINTER FPS: %d\n", (int)fps);
+            timing_report(&timing_);
         }
     }
 
+    replay_close(&replay_);
+
+    if(uploading) {
+        gfx_upload_stop(&gfx_);
+
+        void *ret;
+        pthread_join(painter->upload_thread, &ret);
+        if(ret != (void*)painter)
+            error = -1;
+    }
+
+    timing_free(&timing_);
+
     if(gfx_quit(&gfx_) != 0)
         error = -1;
 
+    // blit and upload threads are gone
+    if(use_tracing)
+        trace_stop(TRACE_PATH);
+
+    pacer_stop(&pacer_);
+
     eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 
+    __atomic_store_n(&painter->exited, 1, __ATOMIC_SEQ_CST);
+    sem_post(&painter->surface_bound);
+
     if(error != 0)
         ANativeActivity_finish(painter->native_activity); // XXX: clean up?
 
@@ -161,60 +588,82 @@ static void *painter_main(void *ptr) {
 }
 
 static void painter_start(struct painter *painter) {
-    pthread_mutex_init(&painter->lock, NULL);
-
-    pthread_condattr_t condattr;
-    pthread_condattr_init(&condattr);
-    pthread_condattr_setclock(&condattr, clock_id);
+    painter->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(painter->wake_fd < 0)
+        LOGW("**** PAINTER EVENTFD FAILED: %d", errno);
 
-    pthread_cond_init(&painter->state_changed, &condattr);
-    pthread_condattr_destroy(&condattr);
+    sem_init(&painter->surface_bound, 0, 0);
 
+    painter->running = 1;
     pthread_create(&painter->painter_thread, NULL, painter_main, painter);
 }
 
-static void painter_dirty(struct painter *painter) {
-    pthread_mutex_lock(&painter->lock);
-    painter->dirty = 1;
-    pthread_cond_signal(&painter->state_changed);
-    pthread_mutex_unlock(&painter->lock);
-}
+// Hand a new window surface, or none, to the running painter and wait
+// until the old one is no longer current.
+static void painter_set_surface(struct painter *painter, EGLSurface surface) {
+    painter->surface = surface;
+    painter_signal(painter, &painter->surface_changed);
 
-static void painter_set_state(struct painter *painter, const struct painter_state *state) {
-    pthread_mutex_lock(&painter->lock);
+    // a painter that quit on an error posts once on its way out
+    if(__atomic_load_n(&painter->exited, __ATOMIC_SEQ_CST))
+        return;
 
-    painter->state.scroll_x += state->scroll_x;
-    painter->state.scroll_y += state->scroll_y;
-    painter->state.scroll_vx = state->scroll_vx;
-    painter->state.scroll_vy = state->scroll_vy;
+    while(sem_wait(&painter->surface_bound) != 0 && errno == EINTR)
+        ;
+}
 
-    painter->dirty = 1;
-    pthread_cond_signal(&painter->state_changed);
+static void painter_dirty(struct painter *painter) {
+    painter_signal(painter, &painter->dirty);
+}
 
-    pthread_mutex_unlock(&painter->lock);
+// Add changes of the input thread and publish the result.
+// NOTE: only called by the input thread, the only writer of the state
+static void painter_set_state(struct painter *painter, const struct painter_state *state, int touching) {
+    struct painter_state *input = &painter->input_state;
+    input->scroll_x += state->scroll_x;
+    input->scroll_y += state->scroll_y;
+    input->scroll_vx = state->scroll_vx;
+    input->scroll_vy = state->scroll_vy;
+    input->scroll_ax = state->scroll_ax;
+    input->scroll_ay = state->scroll_ay;
+    input->zoom += state->zoom;
+    input->rotation += state->rotation;
+    input->slice += state->slice;
+
+    uint32_t words[sizeof(struct painter_state) / sizeof(uint32_t)];
+    memcpy(words, input, sizeof(words));
+
+    uint32_t seq = __atomic_load_n(&painter->state_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&painter->state_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for(size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+        __atomic_store_n(&painter->state_words[i], words[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&painter->touching, touching, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&painter->state_seq, seq + 2, __ATOMIC_RELEASE);
+
+    painter_signal(painter, &painter->dirty);
 }
 
 static void painter_paint(struct painter *painter, int painting) {
-    pthread_mutex_lock(&painter->lock);
-    painter->painting = painting;
-
+    __atomic_store_n(&painter->painting, painting, __ATOMIC_SEQ_CST);
     if(painting)
-        pthread_cond_signal(&painter->state_changed);
-
-    pthread_mutex_unlock(&painter->lock);
+        painter_wake(painter);
 }
 
 static int painter_stop(struct painter *painter) {
-    pthread_mutex_lock(&painter->lock);
-    painter->stopped = 1;
-    pthread_cond_broadcast(&painter->state_changed);
-    pthread_mutex_unlock(&painter->lock);
+    painter_signal(painter, &painter->stopped);
 
     void *ret;
     pthread_join(painter->painter_thread, &ret);
 
-    pthread_mutex_destroy(&painter->lock);
-    pthread_cond_destroy(&painter->state_changed);
+    if(painter->wake_fd >= 0)
+        close(painter->wake_fd);
+    painter->wake_fd = -1;
+
+    sem_destroy(&painter->surface_bound);
+    painter->running = 0;
 
     return ret == (void*)painter ? 0 : -1;
 }
@@ -243,6 +692,29 @@ static void egl_init()
     LOGI("EGL_CLIENT_APIS: %s", eglQueryString(display, EGL_CLIENT_APIS));
     LOGI("EGL_EXTENSIONS: %s", eglQueryString(display, EGL_EXTENSIONS));
 
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    has_surfaceless_context = extensions &&
+        strstr(extensions, "EGL_KHR_surfaceless_context") != NULL;
+
+    // NOTE: partial update includes buffer age
+    if(extensions && strstr(extensions, "EGL_KHR_partial_update") != NULL) {
+        has_buffer_age = 1;
+        set_damage_region = (PFNEGLSETDAMAGEREGIONKHRPROC)
+            eglGetProcAddress("eglSetDamageRegionKHR");
+    } else if(extensions) {
+        has_buffer_age = strstr(extensions, "EGL_EXT_buffer_age") != NULL;
+    }
+
+    if(extensions && strstr(extensions, "EGL_KHR_swap_buffers_with_damage") != NULL)
+        swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    else if(extensions && strstr(extensions, "EGL_EXT_swap_buffers_with_damage") != NULL)
+        swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+            eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
+    LOGI("**** DAMAGE: buffer age %d, set damage region %d, swap with damage %d",
+        has_buffer_age, set_damage_region != NULL, swap_buffers_with_damage != NULL);
+
     int num_configs;
     eglChooseConfig(display, config_attribs, &config, 1, &num_configs);
     eglGetConfigAttrib(display, config, EGL_NATIVE_VISUAL_ID, &native_format);
@@ -255,7 +727,244 @@ static void egl_quit()
     eglTerminate(display);
 }
 
-static void handle_event_key(AInputEvent *event)
+// touch samples of the current gesture, only used by the input thread
+#define MOTION_HISTORY_SIZE (32)
+#define MOTION_WINDOW_NS (100 * 1000000) // velocity is estimated over this
+
+struct motion_sample {
+    int64_t time;
+    float x, y;
+};
+
+static struct motion_tracker {
+    struct motion_sample samples[MOTION_HISTORY_SIZE];
+    int num_samples, next;
+} motion_;
+
+// two finger zoom and rotation, only used by the input thread
+static struct pinch_tracker {
+    int active;
+    float distance, angle;
+} pinch_;
+
+static void pinch_measure(const AInputEvent *event, float *distance, float *angle) {
+    float dx = AMotionEvent_getX(event, 1) - AMotionEvent_getX(event, 0);
+    float dy = AMotionEvent_getY(event, 1) - AMotionEvent_getY(event, 0);
+    *distance = sqrtf(dx*dx + dy*dy);
+    *angle = atan2f(dy, dx);
+}
+
+// changes from all events read in one input callback, handed to the painter
+// at once, only used by the input thread
+static struct input_batch {
+    struct painter_state state; // scroll, zoom and rotation are deltas
+    int touching;
+    int changed;
+} input_;
+
+// Screen movement to texels, content follows the finger. Screen y is down,
+// texture y is up.
+static void screen_to_texels(float dx, float dy, float *tx, float *ty) {
+    // NOTE: zoom and rotation are only changed by the input thread
+    float zoom = painter_.input_state.zoom + input_.state.zoom;
+    float rotation = painter_.input_state.rotation + input_.state.rotation;
+    float scale = exp2f(-zoom);
+    float c = cosf(rotation), s = sinf(rotation);
+    *tx = -(c * dx + s * dy) * scale;
+    *ty = -(s * dx - c * dy) * scale;
+}
+
+static void motion_reset(struct motion_tracker *motion) {
+    motion->num_samples = 0;
+    motion->next = 0;
+}
+
+static void motion_add(struct motion_tracker *motion, int64_t time, float x, float y) {
+    struct motion_sample *sample = &motion->samples[motion->next];
+    sample->time = time;
+    sample->x = x;
+    sample->y = y;
+
+    motion->next = (motion->next + 1) % MOTION_HISTORY_SIZE;
+    if(motion->num_samples < MOTION_HISTORY_SIZE)
+        motion->num_samples += 1;
+}
+
+static const struct motion_sample *motion_sample(const struct motion_tracker *motion, int age) {
+    return &motion->samples[(motion->next - 1 - age + MOTION_HISTORY_SIZE) % MOTION_HISTORY_SIZE];
+}
+
+// Estimate velocity and acceleration (per second) from the samples in the
+// window, velocity over the newer half and the change from the older half.
+static void motion_estimate(
+    const struct motion_tracker *motion,
+    float *vx, float *vy,
+    float *ax, float *ay) {
+    *vx = *vy = *ax = *ay = 0.0;
+
+    if(motion->num_samples < 2)
+        return;
+
+    const struct motion_sample *last = motion_sample(motion, 0);
+
+    int oldest = 0;
+    while(oldest + 1 < motion->num_samples &&
+        last->time - motion_sample(motion, oldest + 1)->time <= MOTION_WINDOW_NS)
+        oldest += 1;
+    if(oldest == 0)
+        return;
+
+    const struct motion_sample *first = motion_sample(motion, oldest);
+    const struct motion_sample *mid = motion_sample(motion, oldest / 2);
+
+    float seconds = 1.0e-9;
+    if(mid == last || mid == first) {
+        float dt = (last->time - first->time) * seconds;
+        *vx = (last->x - first->x) / dt;
+        *vy = (last->y - first->y) / dt;
+        return;
+    }
+
+    float dt0 = (mid->time - first->time) * seconds;
+    float dt1 = (last->time - mid->time) * seconds;
+    if(dt0 <= 0.0 || dt1 <= 0.0)
+        return;
+
+    float vx0 = (mid->x - first->x) / dt0, vy0 = (mid->y - first->y) / dt0;
+    float vx1 = (last->x - mid->x) / dt1, vy1 = (last->y - mid->y) / dt1;
+
+    *vx = vx1;
+    *vy = vy1;
+    *ax = (vx1 - vx0) / (0.5 * (dt0 + dt1));
+    *ay = (vy1 - vy0) / (0.5 * (dt0 + dt1));
+}
+
+// Velocity and acceleration of the batch, replaced by newer events.
+static void input_set_motion(float vx, float vy, float ax, float ay) {
+    screen_to_texels(vx, vy, &input_.state.scroll_vx, &input_.state.scroll_vy);
+    screen_to_texels(ax, ay, &input_.state.scroll_ax, &input_.state.scroll_ay);
+    input_.changed = 1;
+}
+
+// Add the samples batched into a move event and the event itself.
+static void motion_add_event(struct motion_tracker *motion, const AInputEvent *event, size_t pointer_index) {
+    size_t history_size = AMotionEvent_getHistorySize(event);
+    for(size_t h = 0; h < history_size; ++h)
+        motion_add(motion,
+            AMotionEvent_getHistoricalEventTime(event, h),
+            AMotionEvent_getHistoricalX(event, pointer_index, h),
+            AMotionEvent_getHistoricalY(event, pointer_index, h));
+    motion_add(motion,
+        AMotionEvent_getEventTime(event),
+        AMotionEvent_getX(event, pointer_index),
+        AMotionEvent_getY(event, pointer_index));
+}
+
+static void handle_event_motion(AInputEvent *event)
+{
+    size_t pointer_count = AMotionEvent_getPointerCount(event);
+
+    int action = AMotionEvent_getAction(event) & AMOTION_EVENT_ACTION_MASK;
+    size_t pointer_index = 0;
+
+    // moves are too frequent to log
+    if(action != AMOTION_EVENT_ACTION_MOVE)
+        LOGI("**** MOTION EVENT Action: %d  pointers: %d  EventTime: %lld",
+            AMotionEvent_getAction(event), (int)pointer_count,
+            AMotionEvent_getEventTime(event));
+
+    if(action == AMOTION_EVENT_ACTION_DOWN) {
+        motion_reset(&motion_);
+        motion_add(&motion_,
+            AMotionEvent_getEventTime(event),
+            AMotionEvent_getX(event, pointer_index),
+            AMotionEvent_getY(event, pointer_index));
+
+        // catch a fling in flight
+        input_.touching = 1;
+        input_set_motion(0, 0, 0, 0);
+        return;
+    }
+
+    if(action == AMOTION_EVENT_ACTION_UP || action == AMOTION_EVENT_ACTION_CANCEL) {
+        // a released scroll flings on with the velocity it had
+        float vx = 0, vy = 0, ax, ay;
+        if(action == AMOTION_EVENT_ACTION_UP && !pinch_.active && motion_.num_samples > 0) {
+            motion_add_event(&motion_, event, pointer_index);
+            motion_estimate(&motion_, &vx, &vy, &ax, &ay);
+        }
+
+        motion_reset(&motion_);
+        pinch_.active = 0;
+
+        input_.touching = 0;
+        input_set_motion(vx, vy, 0, 0);
+        return;
+    }
+
+    if(action == AMOTION_EVENT_ACTION_POINTER_DOWN && pointer_count == 2) {
+        pinch_.active = 1;
+        pinch_measure(event, &pinch_.distance, &pinch_.angle);
+
+        input_set_motion(0, 0, 0, 0);
+        return;
+    }
+
+    if(action == AMOTION_EVENT_ACTION_POINTER_UP) {
+        // continue scrolling with the finger still down, from where it is
+        size_t up_index = (AMotionEvent_getAction(event) & AMOTION_EVENT_ACTION_POINTER_INDEX_MASK) >>
+            AMOTION_EVENT_ACTION_POINTER_INDEX_SHIFT;
+        size_t down_index = up_index == 0 ? 1 : 0;
+
+        pinch_.active = 0;
+        motion_reset(&motion_);
+        motion_add(&motion_,
+            AMotionEvent_getEventTime(event),
+            AMotionEvent_getX(event, down_index),
+            AMotionEvent_getY(event, down_index));
+        return;
+    }
+
+    if(pinch_.active && pointer_count >= 2) {
+        float distance, angle;
+        pinch_measure(event, &distance, &angle);
+
+        float rotation = angle - pinch_.angle;
+        if(rotation > M_PI) rotation -= 2.0 * M_PI;
+        if(rotation < -M_PI) rotation += 2.0 * M_PI;
+
+        input_.state.rotation += rotation;
+        if(distance > 0.0 && pinch_.distance > 0.0)
+            input_.state.zoom += log2f(distance / pinch_.distance);
+        input_.changed = 1;
+
+        pinch_.distance = distance;
+        pinch_.angle = angle;
+        return;
+    }
+
+    if(pointer_count != 1 || motion_.num_samples == 0)
+        return;
+
+    // scroll by the distance moved since the last sample, including the
+    // samples batched into this event
+    const struct motion_sample *prev = motion_sample(&motion_, 0);
+    float prev_x = prev->x, prev_y = prev->y;
+
+    motion_add_event(&motion_, event, pointer_index);
+
+    const struct motion_sample *last = motion_sample(&motion_, 0);
+    float tx, ty;
+    screen_to_texels(last->x - prev_x, last->y - prev_y, &tx, &ty);
+    input_.state.scroll_x += tx;
+    input_.state.scroll_y += ty;
+
+    float vx, vy, ax, ay;
+    motion_estimate(&motion_, &vx, &vy, &ax, &ay);
+    input_set_motion(vx, vy, ax, ay);
+}
+
+static int handle_event_key(AInputEvent *event)
 {
     LOGI("**** KEY EVENT  Action: %d Flags: %d KeyCode: %d ScanCode: %d MetaState: %x RepeatCount: %d DownTime: %lld EventTime: %lld ", 
         AKeyEvent_getAction(event),
@@ -266,57 +975,34 @@ static void handle_event_key(AInputEvent *event)
         AKeyEvent_getRepeatCount(event),
         AKeyEvent_getDownTime(event),
         AKeyEvent_getEventTime(event));
-}
 
-static void handle_event_motion(AInputEvent *event)
-{
-    LOGI("**** MOTION EVENT Action: %d Flags: %d MetaState: %X DownTime: %lld EventTime: %lld",
-        AMotionEvent_getAction(event),
-        AMotionEvent_getFlags(event),
-        AMotionEvent_getMetaState(event),
-        AMotionEvent_getDownTime(event),
-        AMotionEvent_getEventTime(event));
-
-    size_t pointer_count = AMotionEvent_getPointerCount(event);
-    size_t history_size = AMotionEvent_getHistorySize(event);
-
-    for(size_t pointer_index = 0; pointer_index < pointer_count; ++pointer_index)
-    {
-        LOGI("****    POINTER: %u  x: %3.3f  y: %3.3f  pressure: %3.3f  history size: %d",
-            pointer_index,
-            AMotionEvent_getX(event, pointer_index),
-            AMotionEvent_getY(event, pointer_index),
-            AMotionEvent_getPressure(event, pointer_index),
-            (int)history_size);
+    // volume keys step through the slices of array and 3D layers
+    int32_t key = AKeyEvent_getKeyCode(event);
+    if(key != AKEYCODE_VOLUME_UP && key != AKEYCODE_VOLUME_DOWN)
+        return 0;
 
+    if(AKeyEvent_getAction(event) == AKEY_EVENT_ACTION_DOWN) {
+        input_.state.slice += key == AKEYCODE_VOLUME_UP ? 1.0 : -1.0;
+        input_.changed = 1;
     }
 
-    if(pointer_count == 1 && history_size >= 1) {
-        size_t pointer_index = 0;
-
-        float dx = AMotionEvent_getX(event, pointer_index) -
-            AMotionEvent_getHistoricalX(event, pointer_index, 0);
-        float dy = AMotionEvent_getY(event, pointer_index) -
-            AMotionEvent_getHistoricalY(event, pointer_index, 0);
-
-        struct painter_state new_state = { -dx, dy, 0, 0 };
-        painter_set_state(&painter_, &new_state);
-    }
+    return 1;
 }
 
-static void handle_event(AInputEvent *event)
+static int handle_event(AInputEvent *event)
 {
     switch(AInputEvent_getType(event))
     {
         case AINPUT_EVENT_TYPE_KEY:
-            handle_event_key(event);
-            return;
+            return handle_event_key(event);
         case AINPUT_EVENT_TYPE_MOTION:
             handle_event_motion(event);
-            return;
+            return 0;
         default:
             break;
     }
+
+    return 0;
 }
 
 static int input_callback(int fd, int events, void* data)
@@ -329,22 +1015,23 @@ static int input_callback(int fd, int events, void* data)
     if(has_events < 0)
         LOGW("**** AInputQueue_hasEvents FAILED");
 
-    if(has_events > 0)
+    // drain the queue, the painter gets one state change for all of it
+    AInputEvent* event;
+    while(has_events > 0 && AInputQueue_getEvent(queue, &event) >= 0)
     {
-        AInputEvent* event;
-        if(AInputQueue_getEvent(queue, &event) < 0)
-            LOGW("**** AInputQueue_getEvent FAILED");
-        else
+        if(AInputQueue_preDispatchEvent(queue, event) == 0)
         {
-            if(AInputQueue_preDispatchEvent(queue, event) == 0)
-            {
-                int handled = 0;
-                handle_event(event);
-                AInputQueue_finishEvent(queue, event, handled);
-            }
+            int handled = handle_event(event);
+            AInputQueue_finishEvent(queue, event, handled);
         }
     }
 
+    if(input_.changed) {
+        painter_set_state(&painter_, &input_.state, input_.touching);
+        memset(&input_.state, 0, sizeof(input_.state));
+        input_.changed = 0;
+    }
+
     return 1;
 }
 
@@ -392,10 +1079,21 @@ static void onStop(ANativeActivity* activity)
 
 static void onDestroy(ANativeActivity* activity)
 {
-    (void)activity;
     LOGI("ANativeActivity onDestroy");
 
-    texmmap_close(&texmmap_);
+    // the painter kept running without a surface
+    struct painter *painter = (struct painter*)activity->instance;
+    if(painter->running) {
+        painter_stop(painter);
+
+        if(painter->upload_context != EGL_NO_CONTEXT)
+            eglDestroyContext(display, painter->upload_context);
+        eglDestroyContext(display, painter->context);
+    }
+
+    for(int i = 0; i < num_layers; ++i)
+        texmmap_close(layer_texmmaps[i]);
+    num_layers = 0;
 
     egl_quit();
 }
@@ -444,6 +1142,15 @@ static void onNativeWindowCreated(ANativeActivity* activity, ANativeWindow* nati
 
     EGLSurface surface = eglCreateWindowSurface(display, config, native_window, NULL);
 
+    // textures and pages resident before the window went away are still there
+    struct painter *painter = (struct painter*)activity->instance;
+    if(painter->running) {
+        painter->native_window = native_window;
+        painter_set_surface(painter, surface);
+        painter_paint(painter, 1);
+        return;
+    }
+
     const int context_attribs[] = {
         EGL_CONTEXT_MAJOR_VERSION_KHR, 4,
         EGL_CONTEXT_MINOR_VERSION_KHR, 5,
@@ -453,10 +1160,18 @@ static void onNativeWindowCreated(ANativeActivity* activity, ANativeWindow* nati
     eglBindAPI(EGL_OPENGL_API);
     EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
 
-    struct painter *painter = (struct painter*)activity->instance;
+    // upload context shares textures, buffers and fences with the painter
+    EGLContext upload_context = EGL_NO_CONTEXT;
+    if(use_upload_thread && has_surfaceless_context)
+        upload_context = eglCreateContext(display, config, context, context_attribs);
+
+    // NOTE: the camera starts over with the painter
+    ANativeActivity *native_activity = painter->native_activity;
     memset(painter, 0, sizeof(*painter));
+    painter->native_activity = native_activity;
     painter->native_window = native_window;
     painter->context = context;
+    painter->upload_context = upload_context;
     painter->surface = surface;
     painter_start(painter);
 
@@ -465,8 +1180,11 @@ static void onNativeWindowCreated(ANativeActivity* activity, ANativeWindow* nati
 
 static void onNativeWindowResized(ANativeActivity* activity, ANativeWindow* native_window)
 {
-    (void)activity;
     LOGI("ANativeActivity onNativeWindowResized: %p", native_window);
+
+    // NOTE: rotation keeps the window, the painter picks up the new size
+    struct painter *painter = (struct painter*)activity->instance;
+    painter_dirty(painter);
 }
 
 static void onNativeWindowRedrawNeeded(ANativeActivity* activity, ANativeWindow* native_window)
@@ -482,9 +1200,21 @@ static void onNativeWindowDestroyed(ANativeActivity* activity, ANativeWindow* na
     LOGI("ANativeActivity onNativeWindowDestroyed: %p", native_window);
 
     struct painter *painter = (struct painter*)activity->instance;
+    EGLSurface surface = painter->surface;
+
+    // without surfaceless contexts everything is rebuilt with the next window
+    if(has_surfaceless_context) {
+        painter_paint(painter, 0);
+        painter_set_surface(painter, EGL_NO_SURFACE);
+        eglDestroySurface(display, surface);
+        return;
+    }
+
     painter_stop(painter);
 
-    eglDestroySurface(display, painter->surface);
+    eglDestroySurface(display, surface);
+    if(painter->upload_context != EGL_NO_CONTEXT)
+        eglDestroyContext(display, painter->upload_context);
     eglDestroyContext(display, painter->context);
 }
 
@@ -555,17 +1285,26 @@ void ANativeActivity_onCreate(
     LOGI("*** internal data path: %s\n", activity->internalDataPath);
     LOGI("*** external data path: %s\n", activity->externalDataPath);
 
+    shader_set_cache_dir(activity->internalDataPath);
+
     memset(&painter_, 0, sizeof(painter_));
     painter_.native_activity = activity;
     activity->instance = &painter_;
 
     egl_init();
 
-    //const char *tex_file_name = "scandinavia512.astc";
-    //const char *tex_file_name = "europe1024.astc";
-    const char *tex_file_name = "world16k.astc";
-    if(texmmap_open(activity->internalDataPath, tex_file_name, &texmmap_) != 0) {
-        LOGW("**** Can't mmap texture file %s/%s", activity->internalDataPath, tex_file_name);
-        ANativeActivity_finish(activity);
+    num_layers = 0;
+    for(unsigned i = 0; i < MAX_LAYERS; ++i) {
+        struct texmmap *texmmap = texmmap_get(num_layers);
+        if(texmmap_open(activity->internalDataPath, layer_files[i], texmmap) != 0) {
+            LOGW("**** Can't mmap texture file %s/%s", activity->internalDataPath, layer_files[i]);
+            if(i == 0) {
+                ANativeActivity_finish(activity);
+                break;
+            }
+            continue;
+        }
+
+        layer_texmmaps[num_layers++] = texmmap;
     }
 }
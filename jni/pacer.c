@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include <android/looper.h>
+
+#include <android/log.h>
+#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
+#define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
+
+// vsync timestamps come from AChoreographer when libandroid has it, looked
+// up at run time so older platforms and headless runs fall back to a
+// monotonic clock ticking at the default period
+#define PACER_DEFAULT_PERIOD (1000000000 / 60)
+#define PACER_MIN_PERIOD (1000000000 / 240)
+#define PACER_PERIOD_AVERAGE (16) // samples in the period moving average
+
+typedef struct AChoreographer AChoreographer;
+typedef void (*AChoreographer_frameCallback)(long frame_time_nanos, void *data);
+typedef void (*AChoreographer_frameCallback64)(int64_t frame_time_nanos, void *data);
+
+struct pacer {
+    pthread_mutex_t lock;
+
+    // latest vsync and the smoothed period, CLOCK_MONOTONIC nanoseconds
+    int64_t last_vsync;
+    int64_t period;
+    int num_vsyncs;
+
+    // choreographer thread, callbacks are only posted while active
+    void *libandroid;
+    AChoreographer *(*getInstance)(void);
+    void (*postFrameCallback)(AChoreographer*, AChoreographer_frameCallback, void*);
+    void (*postFrameCallback64)(AChoreographer*, AChoreographer_frameCallback64, void*);
+
+    pthread_t thread;
+    int thread_started;
+    ALooper *looper;
+    int stopped, active, callback_pending;
+};
+
+struct pacer pacer_;
+
+static int64_t pacer_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void pacer_post(struct pacer *pacer);
+
+static void pacer_vsync(struct pacer *pacer, int64_t vsync) {
+    pthread_mutex_lock(&pacer->lock);
+
+    // missed callbacks span several periods
+    int64_t interval = vsync - pacer->last_vsync;
+    if(pacer->num_vsyncs > 0 && interval >= PACER_MIN_PERIOD) {
+        int64_t periods = (interval + pacer->period/2) / pacer->period;
+        int64_t period = interval / (periods > 0 ? periods : 1);
+
+        int n = pacer->num_vsyncs < PACER_PERIOD_AVERAGE ? pacer->num_vsyncs : PACER_PERIOD_AVERAGE;
+        pacer->period = (pacer->period * (n-1) + period) / n;
+    }
+
+    pacer->last_vsync = vsync;
+    pacer->num_vsyncs += 1;
+
+    pacer->callback_pending = 0;
+    if(pacer->active && !pacer->stopped)
+        pacer_post(pacer);
+
+    pthread_mutex_unlock(&pacer->lock);
+}
+
+static void pacer_callback(long frame_time_nanos, void *data) {
+    pacer_vsync((struct pacer*)data, frame_time_nanos);
+}
+
+static void pacer_callback64(int64_t frame_time_nanos, void *data) {
+    pacer_vsync((struct pacer*)data, frame_time_nanos);
+}
+
+// NOTE: called with the lock held, on the choreographer thread
+static void pacer_post(struct pacer *pacer) {
+    AChoreographer *choreographer = pacer->getInstance();
+    if(!choreographer)
+        return;
+
+    // XXX: the long timestamp overflows on 32 bit, only used before API 29
+    if(pacer->postFrameCallback64)
+        pacer->postFrameCallback64(choreographer, pacer_callback64, pacer);
+    else
+        pacer->postFrameCallback(choreographer, pacer_callback, pacer);
+
+    pacer->callback_pending = 1;
+}
+
+static void *pacer_main(void *ptr) {
+    struct pacer *pacer = (struct pacer*)ptr;
+
+    // the choreographer delivers callbacks on the looper of this thread
+    ALooper *looper = ALooper_prepare(ALOOPER_PREPARE_ALLOW_NON_CALLBACKS);
+    ALooper_acquire(looper);
+
+    pthread_mutex_lock(&pacer->lock);
+    pacer->looper = looper;
+    pthread_mutex_unlock(&pacer->lock);
+
+    int stopped = 0;
+    while(!stopped) {
+        pthread_mutex_lock(&pacer->lock);
+        stopped = pacer->stopped;
+        if(!stopped && pacer->active && !pacer->callback_pending)
+            pacer_post(pacer);
+        pthread_mutex_unlock(&pacer->lock);
+
+        if(!stopped)
+            ALooper_pollOnce(-1, NULL, NULL, NULL);
+    }
+
+    pthread_mutex_lock(&pacer->lock);
+    pacer->looper = NULL;
+    pthread_mutex_unlock(&pacer->lock);
+
+    ALooper_release(looper);
+
+    return ptr;
+}
+
+int pacer_start(struct pacer *pacer) {
+    memset(pacer, 0, sizeof(struct pacer));
+    pthread_mutex_init(&pacer->lock, NULL);
+
+    pacer->last_vsync = pacer_time_ns();
+    pacer->period = PACER_DEFAULT_PERIOD;
+
+    pacer->libandroid = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+    if(pacer->libandroid) {
+        pacer->getInstance = (AChoreographer *(*)(void))
+            dlsym(pacer->libandroid, "AChoreographer_getInstance");
+        pacer->postFrameCallback = (void (*)(AChoreographer*, AChoreographer_frameCallback, void*))
+            dlsym(pacer->libandroid, "AChoreographer_postFrameCallback");
+        pacer->postFrameCallback64 = (void (*)(AChoreographer*, AChoreographer_frameCallback64, void*))
+            dlsym(pacer->libandroid, "AChoreographer_postFrameCallback64");
+    }
+
+    if(pacer->getInstance && (pacer->postFrameCallback || pacer->postFrameCallback64) &&
+        pthread_create(&pacer->thread, NULL, pacer_main, pacer) == 0) {
+        pacer->thread_started = 1;
+        LOGI("**** PACER: choreographer vsync");
+    } else {
+        LOGI("**** PACER: monotonic clock, %d Hz", 1000000000 / PACER_DEFAULT_PERIOD);
+    }
+
+    return 0;
+}
+
+void pacer_stop(struct pacer *pacer) {
+    if(pacer->thread_started) {
+        pthread_mutex_lock(&pacer->lock);
+        pacer->stopped = 1;
+        if(pacer->looper)
+            ALooper_wake(pacer->looper);
+        pthread_mutex_unlock(&pacer->lock);
+
+        // NOTE: the looper may not exist yet, pacer_main checks stopped first
+        void *ret;
+        pthread_join(pacer->thread, &ret);
+        pacer->thread_started = 0;
+    }
+
+    if(pacer->libandroid)
+        dlclose(pacer->libandroid);
+    pacer->libandroid = NULL;
+
+    pthread_mutex_destroy(&pacer->lock);
+}
+
+// Vsync callbacks are only needed while frames are painted.
+void pacer_set_active(struct pacer *pacer, int active) {
+    pthread_mutex_lock(&pacer->lock);
+    pacer->active = active;
+    if(active && pacer->looper)
+        ALooper_wake(pacer->looper);
+    pthread_mutex_unlock(&pacer->lock);
+}
+
+uint64_t pacer_period(struct pacer *pacer) {
+    pthread_mutex_lock(&pacer->lock);
+    int64_t period = pacer->period;
+    pthread_mutex_unlock(&pacer->lock);
+
+    return period;
+}
+
+// Predicted time of the first vsync after a point in time, extrapolated
+// from the latest one.
+uint64_t pacer_next_vsync(struct pacer *pacer, uint64_t time) {
+    pthread_mutex_lock(&pacer->lock);
+    int64_t last_vsync = pacer->last_vsync;
+    int64_t period = pacer->period;
+    pthread_mutex_unlock(&pacer->lock);
+
+    if((int64_t)time < last_vsync)
+        return last_vsync;
+
+    return last_vsync + (((int64_t)time - last_vsync) / period + 1) * period;
+}
@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <android/log.h>
+#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
+#define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
+
+// NOTE: same as in main.c and gfx.c
+struct painter_state {
+    float scroll_x, scroll_y;
+    float scroll_vx, scroll_vy; // texels per second
+    float scroll_ax, scroll_ay; // texels per second^2
+    float zoom; // log2 of pixels per texel, about the screen center
+    float rotation; // radians, clockwise on screen
+    float slice; // array layer or 3D slice shown, wraps around the depth
+};
+
+// camera state of every painted frame, a header followed by fixed size
+// little endian records
+#define REPLAY_MAGIC "RPLY"
+#define REPLAY_VERSION (2)
+
+struct replay_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct replay_record {
+    float state[9]; // struct painter_state in declaration order
+    uint16_t width, height; // surface size when recorded
+};
+
+struct replay {
+    FILE *file;
+    int recording;
+    uint64_t num_frames;
+};
+
+struct replay replay_;
+
+int replay_record(struct replay *replay, const char *path) {
+    memset(replay, 0, sizeof(struct replay));
+
+    replay->file = fopen(path, "wb");
+    if(!replay->file) {
+        LOGW("**** REPLAY: can't create %s", path);
+        return -1;
+    }
+
+    struct replay_header header;
+    memcpy(header.magic, REPLAY_MAGIC, 4);
+    header.version = REPLAY_VERSION;
+    header.record_size = sizeof(struct replay_record);
+    if(fwrite(&header, sizeof(header), 1, replay->file) != 1) {
+        fclose(replay->file);
+        replay->file = NULL;
+        return -1;
+    }
+
+    replay->recording = 1;
+    LOGI("**** REPLAY: recording to %s", path);
+
+    return 0;
+}
+
+int replay_open(struct replay *replay, const char *path) {
+    memset(replay, 0, sizeof(struct replay));
+
+    replay->file = fopen(path, "rb");
+    if(!replay->file) {
+        LOGW("**** REPLAY: can't open %s", path);
+        return -1;
+    }
+
+    struct replay_header header;
+    if(fread(&header, sizeof(header), 1, replay->file) != 1 ||
+        memcmp(header.magic, REPLAY_MAGIC, 4) != 0 ||
+        header.version != REPLAY_VERSION ||
+        header.record_size != sizeof(struct replay_record)) {
+        LOGW("**** REPLAY: %s is not a replay file", path);
+        fclose(replay->file);
+        replay->file = NULL;
+        return -1;
+    }
+
+    LOGI("**** REPLAY: playing %s", path);
+
+    return 0;
+}
+
+int replay_write(struct replay *replay, const struct painter_state *state, int width, int height) {
+    if(!replay->file || !replay->recording)
+        return -1;
+
+    struct replay_record record;
+    memcpy(record.state, state, sizeof(record.state));
+    record.width = width;
+    record.height = height;
+
+    if(fwrite(&record, sizeof(record), 1, replay->file) != 1)
+        return -1;
+
+    replay->num_frames += 1;
+    return 0;
+}
+
+// Camera state of the next frame, returns 0 at the end of the file.
+int replay_read(struct replay *replay, struct painter_state *state, int width, int height) {
+    if(!replay->file || replay->recording)
+        return -1;
+
+    struct replay_record record;
+    if(fread(&record, sizeof(record), 1, replay->file) != 1)
+        return 0;
+
+    // XXX: the path is replayed as is, a different surface sees more or less
+    if(replay->num_frames == 0 && (record.width != width || record.height != height))
+        LOGW("**** REPLAY: recorded at %d x %d, playing at %d x %d",
+            record.width, record.height, width, height);
+
+    memcpy(state, record.state, sizeof(record.state));
+    replay->num_frames += 1;
+
+    return 1;
+}
+
+void replay_close(struct replay *replay) {
+    if(replay->file) {
+        fclose(replay->file);
+        LOGI("**** REPLAY: %s %llu frames", replay->recording ? "recorded" : "played",
+            (unsigned long long)replay->num_frames);
+    }
+
+    replay->file = NULL;
+}
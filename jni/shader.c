@@ -1,98 +1,343 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <EGL/egl.h>
 #include <GLXW/glxw.h>
 
+#include "gldebug.h"
+
 #include <android/log.h>
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
 #define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
 
-static GLuint compile_shader(GLenum shader_type, const char *src)
-{
-    GLuint shader = glCreateShader(shader_type);
-    glShaderSource(shader, 1, &src, NULL);
-    glCompileShader(shader);
+// linked programs are cached as driver binaries, one file per source hash in
+// the cache directory; a binary left by another driver is rejected by the
+// key in the header or by glProgramBinary and the program is built from
+// source and cached again
+#define SHADER_CACHE_MAGIC "PBIN"
+#define SHADER_CACHE_VERSION (1)
+#define SHADER_CACHE_MAX_LENGTH (16 * 1024 * 1024)
+#define SHADER_MAX_BUILDS (4) // programs started and not finished yet
+#define SHADER_NUM_STAGES (5)
+
+// NOTE: KHR_parallel_shader_compile, not in glcorearb.h
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+struct shader_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t driver_hash; // GL_VENDOR, GL_RENDERER and GL_VERSION
+    uint64_t source_hash;
+    uint32_t format; // from glGetProgramBinary
+    uint32_t length;
+};
+
+struct shader_build {
+    GLuint prog; // 0 if the slot is free
+    GLuint shaders[SHADER_NUM_STAGES]; // all 0 if loaded from the cache
+    uint64_t driver_hash, source_hash;
+    int cacheable;
+    uint64_t start_time;
+};
+
+struct shader {
+    char cache_dir[256]; // empty if not caching
+    struct shader_build builds[SHADER_MAX_BUILDS];
+};
+
+struct shader shader_;
+
+static uint64_t shader_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// FNV-1a, including the terminating zero so adjacent strings don't run together
+static uint64_t shader_hash(uint64_t hash, const char *str) {
+    if(!str)
+        str = "";
 
+    do {
+        hash ^= (uint8_t)*str;
+        hash *= 0x100000001b3ull;
+    } while(*str++);
+
+    return hash;
+}
+
+#define SHADER_HASH_INIT (0xcbf29ce484222325ull)
+
+static void shader_cache_path(char *path, size_t size, uint64_t source_hash) {
+    snprintf(path, size, "%s/program-%016llx.bin",
+        shader_.cache_dir, (unsigned long long)source_hash);
+}
+
+// Set before the first program is built, an empty path turns caching off.
+void shader_set_cache_dir(const char *dir) {
+    snprintf(shader_.cache_dir, sizeof(shader_.cache_dir), "%s", dir ? dir : "");
+}
+
+static void shader_log(GLuint shader) {
     GLint status;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if(status != GL_TRUE)
-    {
-        GLint size;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &size);
+    if(status == GL_TRUE)
+        return;
 
-        char buffer[size+1];
-        GLsizei len;
-        glGetShaderInfoLog(shader, size, &len, buffer);
-        buffer[len] = 0;
+    GLint size;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &size);
 
-        LOGW("Shader compiler error:\n%s\n", buffer);
+    char buffer[size+1];
+    GLsizei len = 0;
+    glGetShaderInfoLog(shader, size, &len, buffer);
+    buffer[len] = 0;
 
-        glDeleteShader(shader);
-        return 0;
-    }
+    LOGW("Shader compiler error:\n%s\n", buffer);
+}
+
+static void program_log(GLuint prog) {
+    GLint size;
+    glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &size);
 
-    return shader;
+    char buffer[size+1];
+    GLsizei len = 0;
+    glGetProgramInfoLog(prog, size, &len, buffer);
+    buffer[len] = 0;
+
+    LOGW("Program linking error:\n%s\n", buffer);
 }
 
-static GLuint link_program(const GLuint *shaders, int num_shaders)
-{
-    GLuint prog = glCreateProgram();
+static int shader_load(struct shader_build *build) {
+    char path[sizeof(shader_.cache_dir) + 32];
+    shader_cache_path(path, sizeof(path), build->source_hash);
 
-    for(int i = 0; i < num_shaders; ++i)
-        if(shaders[i])
-            glAttachShader(prog, shaders[i]);
+    FILE *file = fopen(path, "rb");
+    if(!file)
+        return -1;
 
-    glLinkProgram(prog);
+    struct shader_cache_header header;
+    void *data = NULL;
+    if(fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, SHADER_CACHE_MAGIC, 4) != 0 ||
+        header.version != SHADER_CACHE_VERSION ||
+        header.source_hash != build->source_hash ||
+        header.length == 0 || header.length > SHADER_CACHE_MAX_LENGTH) {
+        LOGW("**** SHADER: %s is not a program binary", path);
+        fclose(file);
+        return -1;
+    }
+
+    if(header.driver_hash != build->driver_hash) {
+        LOGI("**** SHADER: driver changed since %s was cached", path);
+        fclose(file);
+        return -1;
+    }
+
+    data = malloc(header.length);
+    if(!data || fread(data, header.length, 1, file) != 1) {
+        LOGW("**** SHADER: can't read %s", path);
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    GLuint prog = glCreateProgram();
+    glProgramBinary(prog, header.format, data, header.length);
+    free(data);
 
+    // NOTE: a driver may reject binaries of its own for any reason
     GLint status;
     glGetProgramiv(prog, GL_LINK_STATUS, &status);
-    if(status != GL_TRUE)
-    {
-        GLint size;
-        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &size);
+    if(status != GL_TRUE) {
+        LOGI("**** SHADER: binary in %s rejected by the driver", path);
+        glDeleteProgram(prog);
+        return -1;
+    }
 
-        char buffer[size+1];
-        GLsizei len;
-        glGetProgramInfoLog(prog, size, &len, buffer);
-        buffer[len] = 0;
+    build->prog = prog;
+    return 0;
+}
 
-        LOGW("Program linking error:\n%s\n", buffer);
+static void shader_save(const struct shader_build *build) {
+    GLint length = 0;
+    glGetProgramiv(build->prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0 || length > SHADER_CACHE_MAX_LENGTH)
+        return;
 
-        glDeleteProgram(prog);
-        return 0;
+    void *data = malloc(length);
+    if(!data)
+        return;
+
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(build->prog, length, &written, &format, data);
+
+    struct shader_cache_header header;
+    memcpy(header.magic, SHADER_CACHE_MAGIC, 4);
+    header.version = SHADER_CACHE_VERSION;
+    header.driver_hash = build->driver_hash;
+    header.source_hash = build->source_hash;
+    header.format = format;
+    header.length = written;
+
+    // written aside and renamed over, a crash never leaves half a binary
+    char path[sizeof(shader_.cache_dir) + 32], tmp_path[sizeof(path) + 4];
+    shader_cache_path(path, sizeof(path), build->source_hash);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    int ok = file && written > 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(data, written, 1, file) == 1;
+    if(file && fclose(file) != 0)
+        ok = 0;
+    free(data);
+
+    if(!ok || rename(tmp_path, path) != 0) {
+        LOGW("**** SHADER: can't write %s", path);
+        remove(tmp_path);
+        return;
     }
 
-    return prog;
+    LOGI("**** SHADER: cached %d bytes in %s", (int)written, path);
+}
+
+static struct shader_build *shader_find(GLuint prog) {
+    for(int i = 0; prog && i < SHADER_MAX_BUILDS; ++i)
+        if(shader_.builds[i].prog == prog)
+            return &shader_.builds[i];
+
+    return NULL;
+}
+
+static void shader_build_free(struct shader_build *build) {
+    for(int i = 0; i < SHADER_NUM_STAGES; ++i)
+        if(build->shaders[i])
+            glDeleteShader(build->shaders[i]);
+
+    memset(build, 0, sizeof(struct shader_build));
 }
 
-unsigned shader_compile(const char *vert, const char *tess_ctrl, const char *tess_eval, const char *geom, const char *frag)
+// Start building a program, from the cache if there is a binary for this
+// source and driver. Compile and link results are not waited for, with
+// KHR_parallel_shader_compile the driver builds on its own threads while the
+// caller goes on; shader_finish returns the program once it's usable.
+unsigned shader_begin(const char *vert, const char *tess_ctrl, const char *tess_eval, const char *geom, const char *frag)
 {
-    GLenum types[] = {
+    GLenum types[SHADER_NUM_STAGES] = {
         GL_VERTEX_SHADER,
         GL_TESS_CONTROL_SHADER,
         GL_TESS_EVALUATION_SHADER,
         GL_GEOMETRY_SHADER,
         GL_FRAGMENT_SHADER
     };
-    const int num_shaders = sizeof(types)/sizeof(*types);
-    const char *srcs[] = { vert, tess_ctrl, tess_eval, geom, frag };
-    GLuint shaders[num_shaders];
-    GLuint prog = 0;
+    const char *srcs[SHADER_NUM_STAGES] = { vert, tess_ctrl, tess_eval, geom, frag };
 
-    for(int i = 0; i < num_shaders; ++i)
-    {
-        shaders[i] = 0;
+    struct shader_build *build = NULL;
+    for(int i = 0; !build && i < SHADER_MAX_BUILDS; ++i)
+        if(!shader_.builds[i].prog)
+            build = &shader_.builds[i];
+
+    if(!build) {
+        LOGW("**** SHADER: more than %d programs building", SHADER_MAX_BUILDS);
+        return 0;
+    }
+
+    memset(build, 0, sizeof(struct shader_build));
+    build->start_time = shader_time_ns();
+
+    build->driver_hash = SHADER_HASH_INIT;
+    build->driver_hash = shader_hash(build->driver_hash, (const char*)glGetString(GL_VENDOR));
+    build->driver_hash = shader_hash(build->driver_hash, (const char*)glGetString(GL_RENDERER));
+    build->driver_hash = shader_hash(build->driver_hash, (const char*)glGetString(GL_VERSION));
+
+    build->source_hash = SHADER_HASH_INIT;
+    for(int i = 0; i < SHADER_NUM_STAGES; ++i)
+        build->source_hash = shader_hash(build->source_hash, srcs[i]);
+
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    build->cacheable = shader_.cache_dir[0] && num_formats > 0;
+
+    if(build->cacheable && shader_load(build) == 0)
+        return build->prog;
+
+    // XXX: looked up on every build, it's per context and cheap
+    if(gl_has_extension("GL_KHR_parallel_shader_compile")) {
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_threads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)
+            eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        if(max_threads)
+            max_threads(0xffffffff); // as many as the driver likes
+    }
 
+    GLuint prog = glCreateProgram();
+    for(int i = 0; i < SHADER_NUM_STAGES; ++i)
+    {
         if(!srcs[i] || !srcs[i][0]) continue;
-        if(!(shaders[i] = compile_shader(types[i], srcs[i])))
-            goto finish;
+
+        GLuint shader = glCreateShader(types[i]);
+        glShaderSource(shader, 1, &srcs[i], NULL);
+        glCompileShader(shader);
+        glAttachShader(prog, shader);
+        build->shaders[i] = shader;
     }
 
-    prog = link_program(shaders, num_shaders);
+    if(build->cacheable)
+        glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(prog);
 
-finish:
-    for(int i = 0; i < num_shaders; ++i)
+    build->prog = prog;
+    return prog;
+}
+
+// Wait for a program started by shader_begin and cache it if it was built
+// from source, returns 0 and deletes the program if it failed.
+unsigned shader_finish(unsigned prog)
+{
+    struct shader_build *build = shader_find(prog);
+    if(!build)
+        return prog;
+
+    int cached = 1;
+    for(int i = 0; i < SHADER_NUM_STAGES; ++i)
+        if(build->shaders[i])
+            cached = 0;
+
+    GLint status;
+    glGetProgramiv(prog, GL_LINK_STATUS, &status);
+    if(status != GL_TRUE)
     {
-        if(shaders[i])
-            glDeleteShader(shaders[i]);
+        for(int i = 0; i < SHADER_NUM_STAGES; ++i)
+            if(build->shaders[i])
+                shader_log(build->shaders[i]);
+        program_log(prog);
+
+        glDeleteProgram(prog);
+        shader_build_free(build);
+        return 0;
     }
 
+    LOGI("**** SHADER: program %016llx %s in %.2f ms",
+        (unsigned long long)build->source_hash, cached ? "loaded" : "built",
+        (shader_time_ns() - build->start_time) / 1.0e6);
+
+    if(!cached && build->cacheable)
+        shader_save(build);
+
+    shader_build_free(build);
     return prog;
 }
+
+// Delete a program, finished or not.
+void shader_delete(unsigned prog)
+{
+    struct shader_build *build = shader_find(prog);
+    if(build)
+        shader_build_free(build);
+
+    glDeleteProgram(prog);
+}
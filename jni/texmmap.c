@@ -19,7 +19,16 @@ struct texmmap {
     void *mmap_ptr;
 };
 
-struct texmmap texmmap_;
+#define TEXMMAP_MAX_FILES (4)
+
+struct texmmap texmmaps_[TEXMMAP_MAX_FILES];
+
+struct texmmap *texmmap_get(int index) {
+    if(index < 0 || index >= TEXMMAP_MAX_FILES)
+        return NULL;
+
+    return &texmmaps_[index];
+}
 
 int texmmap_open(const char *dir, const char *filename, struct texmmap* texmmap) {
     memset(texmmap, 0, sizeof(struct texmmap));
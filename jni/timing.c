@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <GLXW/glxw.h>
+
+#include <android/log.h>
+#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
+#define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
+
+// frames are broken down into phases timed on the CPU with the monotonic
+// clock and on the GPU with timestamp queries
+// NOTE: the same phases are used by main.c and gfx.c
+enum timing_phase {
+    TIMING_FINISH, // xfer_finish and pool update
+    TIMING_REQUEST, // feedback, prefetch and page requests
+    TIMING_DRAW,
+    TIMING_UPLOAD, // xfer_upload on the painter context
+    TIMING_SWAP,
+    TIMING_NUM_PHASES
+};
+
+static const char *timing_phase_names[TIMING_NUM_PHASES] = {
+    "finish", "request", "draw", "upload", "swap"
+};
+
+#define TIMING_HISTORY (256) // frames kept for summaries
+#define TIMING_QUERY_FRAMES (8) // frames waiting for GPU timestamps
+
+struct timing_frame {
+    uint64_t frame_number;
+    uint64_t period; // vsync period the frame was meant to fit in
+    uint64_t cpu[TIMING_NUM_PHASES];
+    uint64_t gpu[TIMING_NUM_PHASES];
+    uint64_t cpu_total, gpu_total;
+    int gpu_valid;
+};
+
+struct timing_query {
+    unsigned timestamps[TIMING_NUM_PHASES][2]; // GL_TIMESTAMP around each phase
+    int used[TIMING_NUM_PHASES];
+    struct timing_frame frame;
+};
+
+// NOTE: owned by the painter thread and its context
+struct timing {
+    // frame being painted
+    int query_idx; // -1 if GPU timing is skipped for this frame
+    uint64_t frame_start;
+    uint64_t phase_start[TIMING_NUM_PHASES];
+    struct timing_frame current;
+
+    // frames waiting for GPU results, oldest first
+    struct timing_query queries[TIMING_QUERY_FRAMES];
+    int query_rd, query_wr;
+
+    // completed frames
+    struct timing_frame history[TIMING_HISTORY];
+    int history_idx, num_history;
+    uint64_t missed_frames;
+};
+
+struct timing timing_;
+
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+static uint64_t timing_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+int timing_init(struct timing *timing) {
+    memset(timing, 0, sizeof(struct timing));
+    timing->query_idx = -1;
+
+    for(int i = 0; i < TIMING_QUERY_FRAMES; ++i)
+        glGenQueries(2 * TIMING_NUM_PHASES, &timing->queries[i].timestamps[0][0]);
+
+    return 0;
+}
+
+void timing_free(struct timing *timing) {
+    for(int i = 0; i < TIMING_QUERY_FRAMES; ++i)
+        glDeleteQueries(2 * TIMING_NUM_PHASES, &timing->queries[i].timestamps[0][0]);
+}
+
+void timing_frame_begin(struct timing *timing, uint64_t frame_number) {
+    memset(&timing->current, 0, sizeof(struct timing_frame));
+    timing->current.frame_number = frame_number;
+    timing->frame_start = timing_time_ns();
+
+    // pool exhausted, skip GPU timing rather than stall
+    int next = (timing->query_wr + 1) % TIMING_QUERY_FRAMES;
+    timing->query_idx = next == timing->query_rd ? -1 : timing->query_wr;
+    if(timing->query_idx >= 0)
+        memset(timing->queries[timing->query_idx].used, 0, sizeof(timing->queries[0].used));
+}
+
+void timing_phase_begin(struct timing *timing, int phase) {
+    trace_begin(timing_phase_names[phase]);
+    timing->phase_start[phase] = timing_time_ns();
+
+    if(timing->query_idx >= 0) {
+        struct timing_query *query = &timing->queries[timing->query_idx];
+        glQueryCounter(query->timestamps[phase][0], GL_TIMESTAMP);
+    }
+}
+
+void timing_phase_end(struct timing *timing, int phase) {
+    timing->current.cpu[phase] += timing_time_ns() - timing->phase_start[phase];
+
+    // XXX: a phase entered twice in a frame only times the GPU on the last one
+    if(timing->query_idx >= 0) {
+        struct timing_query *query = &timing->queries[timing->query_idx];
+        glQueryCounter(query->timestamps[phase][1], GL_TIMESTAMP);
+        query->used[phase] = 1;
+    }
+
+    trace_end(timing_phase_names[phase]);
+}
+
+static void timing_add(struct timing *timing, const struct timing_frame *frame) {
+    timing->history[timing->history_idx] = *frame;
+    timing->history_idx = (timing->history_idx + 1) % TIMING_HISTORY;
+    if(timing->num_history < TIMING_HISTORY)
+        timing->num_history += 1;
+
+    // blame the phase that took longest on the side that went over
+    int gpu_missed = frame->gpu_valid && frame->gpu_total > frame->period;
+    if(frame->period == 0 || (frame->cpu_total <= frame->period && !gpu_missed))
+        return;
+
+    const uint64_t *times = gpu_missed ? frame->gpu : frame->cpu;
+    int worst = 0;
+    for(int i = 1; i < TIMING_NUM_PHASES; ++i)
+        if(times[i] > times[worst])
+            worst = i;
+
+    timing->missed_frames += 1;
+    LOGW("**** FRAME %llu MISSED: cpu %.2f ms, gpu %.2f ms, period %.2f ms, %s %s %.2f ms",
+        (unsigned long long)frame->frame_number,
+        frame->cpu_total / 1.0e6, frame->gpu_total / 1.0e6, frame->period / 1.0e6,
+        gpu_missed ? "gpu" : "cpu", timing_phase_names[worst], times[worst] / 1.0e6);
+}
+
+// The frame was presented, CPU times are final and GPU times follow once
+// the queries are available.
+void timing_frame_end(struct timing *timing, uint64_t period) {
+    struct timing_frame *frame = &timing->current;
+    frame->period = period;
+    frame->cpu_total = timing_time_ns() - timing->frame_start;
+
+    if(timing->query_idx < 0) {
+        timing_add(timing, frame);
+        return;
+    }
+
+    timing->queries[timing->query_idx].frame = *frame;
+    timing->query_wr = (timing->query_idx + 1) % TIMING_QUERY_FRAMES;
+    timing->query_idx = -1;
+}
+
+int timing_poll(struct timing *timing) {
+    int num_results = 0;
+    while(timing->query_rd != timing->query_wr) {
+        struct timing_query *query = &timing->queries[timing->query_rd];
+
+        // queries complete in order, the last one of the frame is enough
+        int last = -1;
+        for(int i = 0; i < TIMING_NUM_PHASES; ++i)
+            if(query->used[i])
+                last = i;
+
+        if(last >= 0) {
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(query->timestamps[last][1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available)
+                break;
+        }
+
+        struct timing_frame *frame = &query->frame;
+        uint64_t first_start = 0, last_end = 0;
+        for(int i = 0; i < TIMING_NUM_PHASES; ++i) {
+            if(!query->used[i])
+                continue;
+
+            uint64_t time_start = 0, time_end = 0;
+            glGetQueryObjectui64v(query->timestamps[i][0], GL_QUERY_RESULT, &time_start);
+            glGetQueryObjectui64v(query->timestamps[i][1], GL_QUERY_RESULT, &time_end);
+            frame->gpu[i] = time_end - time_start;
+
+            if(first_start == 0 || time_start < first_start)
+                first_start = time_start;
+            if(time_end > last_end)
+                last_end = time_end;
+        }
+        frame->gpu_total = last_end - first_start;
+        frame->gpu_valid = last >= 0;
+
+        timing_add(timing, frame);
+
+        timing->query_rd = (timing->query_rd + 1) % TIMING_QUERY_FRAMES;
+        num_results += 1;
+    }
+
+    return num_results;
+}
+
+static int timing_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void timing_summary(const char *name, uint64_t *times, int n) {
+    if(n == 0)
+        return;
+
+    qsort(times, n, sizeof(uint64_t), timing_compare);
+
+    uint64_t sum = 0;
+    for(int i = 0; i < n; ++i)
+        sum += times[i];
+
+    LOGI("**** TIMING %-12s min %6.2f  avg %6.2f  p95 %6.2f  p99 %6.2f  max %6.2f ms",
+        name, times[0] / 1.0e6, (double)sum / n / 1.0e6,
+        times[(n * 95) / 100] / 1.0e6, times[(n * 99) / 100] / 1.0e6,
+        times[n-1] / 1.0e6);
+}
+
+// Log min, average and percentiles of each phase over the frames kept.
+void timing_report(struct timing *timing) {
+    int n = timing->num_history;
+    if(n == 0)
+        return;
+
+    LOGI("**** TIMING: %d frames, %llu missed", n, (unsigned long long)timing->missed_frames);
+
+    uint64_t times[TIMING_HISTORY];
+    char name[32];
+    for(int gpu = 0; gpu < 2; ++gpu) {
+        for(int phase = 0; phase <= TIMING_NUM_PHASES; ++phase) {
+            int num_times = 0;
+            for(int i = 0; i < n; ++i) {
+                const struct timing_frame *frame = &timing->history[i];
+                if(gpu && !frame->gpu_valid)
+                    continue;
+
+                if(phase == TIMING_NUM_PHASES)
+                    times[num_times++] = gpu ? frame->gpu_total : frame->cpu_total;
+                else
+                    times[num_times++] = gpu ? frame->gpu[phase] : frame->cpu[phase];
+            }
+
+            snprintf(name, sizeof(name), "%s %s", gpu ? "gpu" : "cpu",
+                phase == TIMING_NUM_PHASES ? "frame" : timing_phase_names[phase]);
+            timing_summary(name, times, num_times);
+        }
+    }
+}
@@ -0,0 +1,232 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <android/log.h>
+#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, __FILE__, __VA_ARGS__))
+#define LOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, __FILE__, __VA_ARGS__))
+
+// trace events are appended to a buffer owned by the emitting thread and
+// written out as Chrome JSON trace when tracing stops, which chrome://tracing
+// and the Perfetto UI both open
+// NOTE: names must be string literals, only the pointer is kept
+#define TRACE_BUFFER_EVENTS (16384) // per thread, later events are dropped
+
+struct trace_event {
+    uint64_t time;
+    const char *name;
+    uint64_t id; // flow id or counter value
+    char phase; // Chrome trace event type
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    int in_use; // NOTE: atomic, cleared when the owning thread exits
+    int tid;
+    const char *thread_name;
+
+    struct trace_event events[TRACE_BUFFER_EVENTS];
+    int num_events;
+    uint64_t dropped;
+};
+
+struct trace {
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    int enabled; // NOTE: atomic
+
+    struct trace_buffer *buffers; // all threads that ever traced
+};
+
+struct trace trace_ = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL };
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buffer *trace_local = NULL;
+
+static uint64_t trace_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Thread exited, its events stay until tracing starts again.
+static void trace_thread_exit(void *ptr) {
+    struct trace_buffer *buffer = (struct trace_buffer*)ptr;
+    __atomic_store_n(&buffer->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void) {
+    pthread_key_create(&trace_.key, trace_thread_exit);
+}
+
+static struct trace_buffer *trace_buffer_get(void) {
+    if(trace_local)
+        return trace_local;
+
+    pthread_once(&trace_once, trace_key_init);
+
+    pthread_mutex_lock(&trace_.lock);
+
+    // reuse an empty buffer left by a thread that exited
+    struct trace_buffer *buffer = trace_.buffers;
+    while(buffer && (__atomic_load_n(&buffer->in_use, __ATOMIC_ACQUIRE) ||
+        buffer->num_events > 0))
+        buffer = buffer->next;
+
+    if(!buffer) {
+        buffer = (struct trace_buffer*)calloc(1, sizeof(struct trace_buffer));
+        if(buffer) {
+            buffer->next = trace_.buffers;
+            trace_.buffers = buffer;
+        }
+    }
+
+    if(buffer) {
+        buffer->in_use = 1;
+        buffer->tid = (int)syscall(SYS_gettid);
+        buffer->thread_name = NULL;
+    }
+
+    pthread_mutex_unlock(&trace_.lock);
+
+    if(buffer)
+        pthread_setspecific(trace_.key, buffer);
+    trace_local = buffer;
+
+    return buffer;
+}
+
+static void trace_event(char phase, const char *name, uint64_t id) {
+    if(!__atomic_load_n(&trace_.enabled, __ATOMIC_RELAXED))
+        return;
+
+    struct trace_buffer *buffer = trace_buffer_get();
+    if(!buffer)
+        return;
+
+    int num = buffer->num_events;
+    if(num == TRACE_BUFFER_EVENTS) {
+        buffer->dropped += 1;
+        return;
+    }
+
+    struct trace_event *event = &buffer->events[num];
+    event->time = trace_time_ns();
+    event->name = name;
+    event->id = id;
+    event->phase = phase;
+
+    // published for trace_stop, which may run while this thread traces
+    __atomic_store_n(&buffer->num_events, num + 1, __ATOMIC_RELEASE);
+}
+
+void trace_begin(const char *name) {
+    trace_event('B', name, 0);
+}
+
+void trace_end(const char *name) {
+    trace_event('E', name, 0);
+}
+
+// Flow arrows connect the slices enclosing these events, keyed by an id
+// such as the transfer id.
+void trace_flow_begin(const char *name, uint64_t id) {
+    trace_event('s', name, id);
+}
+
+void trace_flow_step(const char *name, uint64_t id) {
+    trace_event('t', name, id);
+}
+
+void trace_flow_end(const char *name, uint64_t id) {
+    trace_event('f', name, id);
+}
+
+void trace_counter(const char *name, uint64_t value) {
+    trace_event('C', name, value);
+}
+
+void trace_thread_name(const char *name) {
+    if(!__atomic_load_n(&trace_.enabled, __ATOMIC_RELAXED))
+        return;
+
+    struct trace_buffer *buffer = trace_buffer_get();
+    if(buffer)
+        buffer->thread_name = name;
+}
+
+void trace_start(void) {
+    pthread_mutex_lock(&trace_.lock);
+    for(struct trace_buffer *buffer = trace_.buffers; buffer; buffer = buffer->next) {
+        buffer->num_events = 0;
+        buffer->dropped = 0;
+    }
+    pthread_mutex_unlock(&trace_.lock);
+
+    __atomic_store_n(&trace_.enabled, 1, __ATOMIC_RELEASE);
+    LOGI("**** TRACE: started");
+}
+
+// Stop tracing and write out what was recorded.
+// NOTE: threads still tracing may lose their last events
+int trace_stop(const char *path) {
+    __atomic_store_n(&trace_.enabled, 0, __ATOMIC_RELEASE);
+
+    FILE *file = fopen(path, "w");
+    if(!file) {
+        LOGW("**** TRACE: can't open %s", path);
+        return -1;
+    }
+
+    int pid = (int)getpid();
+    uint64_t num_events = 0, dropped = 0;
+
+    pthread_mutex_lock(&trace_.lock);
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for(struct trace_buffer *buffer = trace_.buffers; buffer; buffer = buffer->next) {
+        if(buffer->thread_name) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                separator, pid, buffer->tid, buffer->thread_name);
+            separator = ",\n";
+        }
+
+        int num = __atomic_load_n(&buffer->num_events, __ATOMIC_ACQUIRE);
+        for(int i = 0; i < num; ++i) {
+            const struct trace_event *event = &buffer->events[i];
+
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"xfer\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                separator, event->name, event->phase, event->time / 1.0e3, pid, buffer->tid);
+            separator = ",\n";
+
+            if(event->phase == 'C')
+                fprintf(file, ",\"args\":{\"value\":%llu}}", (unsigned long long)event->id);
+            else if(event->phase == 'f') // binds to the enclosing slice
+                fprintf(file, ",\"id\":%llu,\"bp\":\"e\"}", (unsigned long long)event->id);
+            else if(event->phase == 's' || event->phase == 't')
+                fprintf(file, ",\"id\":%llu}", (unsigned long long)event->id);
+            else
+                fprintf(file, "}");
+        }
+
+        num_events += num;
+        dropped += buffer->dropped;
+    }
+    fprintf(file, "\n]}\n");
+
+    pthread_mutex_unlock(&trace_.lock);
+
+    fclose(file);
+
+    LOGI("**** TRACE: %llu events, %llu dropped, written to %s",
+        (unsigned long long)num_events, (unsigned long long)dropped, path);
+
+    return 0;
+}